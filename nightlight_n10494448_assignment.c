@@ -1,30 +1,80 @@
-// headers
-#include <stdint.h>
-#include <stdio.h>
-#include <avr/io.h> 
-#include <avr/interrupt.h>
-#include <util/delay.h>
-#include <string.h>
-
-// macro definitions
-#define SET_BIT(reg, pin)           (reg) |= (1 << (pin))
-#define SET_BITS(reg, mask)			(reg) |= mask
-#define CLEAR_BIT(reg, pin)         (reg) &= ~(1 << (pin))
-#define WRITE_BIT(reg, pin, value)  (reg) = (((reg) & ~(1 << (pin))) | ((value) << (pin)))
-#define BIT_VALUE(reg, pin)         (((reg) >> (pin)) & 1)
-#define BIT_IS_SET(reg, pin)        (BIT_VALUE((reg),(pin))==1)
-#define CLEAR_BITS(reg, mask)		(reg) &= ~mask 
-#define TOGGLE_BIT(reg, pin)	reg^= (1 << pin)
+//**** BOARD DEFINITIONS ****//
+// everything that depends on the board and how it is wired is defined here
+// pick a board when compiling with e.g. -DBOARD=BOARD_PRO_MINI_8MHZ
+#define BOARD_UNO (1)            // Arduino UNO: ATmega328P, 5V 16MHz (default)
+#define BOARD_PRO_MINI_8MHZ (2)  // ATmega328P, 3.3V 8MHz
+#define BOARD_328PB (3)          // ATmega328PB, 5V 16MHz (compile with -mmcu=atmega328pb)
+
+#ifndef BOARD
+#define BOARD BOARD_UNO
+#endif
+
+// USART0, timer 2 (OC2A) and the TWI are needed so only the ATmega328 family is supported
+#if !defined(__AVR_ATmega328P__) && !defined(__AVR_ATmega328PB__) && !defined(__AVR_ATmega328__)
+#error "unsupported MCU: the nightlight needs an ATmega328P/328PB"
+#endif
+
+#if BOARD == BOARD_PRO_MINI_8MHZ
+  #ifndef F_CPU
+  #define F_CPU 8000000UL
+  #endif
+  // 57600 baud can't be made accurately from 8MHz
+  #define BAUD_RATE 38400
+#else
+  #ifndef F_CPU
+  #define F_CPU 16000000UL
+  #endif
+  #define BAUD_RATE 57600
+#endif
+
+// timer 0 (debouncing, LED matrix and animation timing) overflows every TIMER0_PRESCALER * 256 cycles, 977Hz at 16MHz
+// (6ms of debouncing, 195Hz matrix refresh) and 488Hz at 8MHz. Everything timed in overflows is derived from this
+#define TIMER0_PRESCALER 64
+#if TIMER0_PRESCALER == 8
+  #define TIMER0_CLOCK_SELECT (1 << CS01)
+#elif TIMER0_PRESCALER == 64
+  #define TIMER0_CLOCK_SELECT (1 << CS01 | 1 << CS00)
+#elif TIMER0_PRESCALER == 256
+  #define TIMER0_CLOCK_SELECT (1 << CS02)
+#else
+  #error "TIMER0_PRESCALER must be 8, 64 or 256"
+#endif
+
+#if BOARD == BOARD_328PB && !defined(__AVR_ATmega328PB__)
+#error "BOARD_328PB needs -mmcu=atmega328pb"
+#endif
+
+// the 328PB names its peripherals after the first of two: map the ones used here onto the 328P names
+// (keyed off the MCU rather than BOARD so any board built for a 328PB gets them)
+#if defined(__AVR_ATmega328PB__)
+  #define TWBR TWBR0
+  #define TWSR TWSR0
+  #define TWDR TWDR0
+  #define TWCR TWCR0
+  #define TWI_vect TWI0_vect
+  #ifndef USART_RX_vect
+  #define USART_RX_vect USART0_RX_vect
+  #define USART_UDRE_vect USART0_UDRE_vect
+  #define USART_TX_vect USART0_TX_vect
+  #endif
+#endif
 
-// constant definitions
-#define BAUD_RATE 57600
-//#define F_CPU 16000000
-#define UBRR (F_CPU / 16 / BAUD_RATE - 1)
+// light bulb on OC2A (timer 2 PWM output)
+#define BULB_DDR (DDRB)
+#define BULB_INPUT (PINB)
+#define BULB_PIN (3)
 
-// LCD definitions copied from WK11 topic on LCDs
-#define LCD_USING_4PIN_MODE (1)
+// push button, reads 1 when pressed
+#define BUTTON_DDR (DDRB)
+#define BUTTON_INPUT (PINB)
+#define BUTTON_PIN (5)
 
+// LCD wiring, set LCD_USING_I2C to 1 to drive the LCD through a PCF8574 I2C backpack on SDA (PC4) and SCL (PC5)
+// instead of the 6 GPIO pins below (the backpack only wires up D4-D7 so it needs 4 pin mode)
 #define LCD_USING_4PIN_MODE (1)
+#ifndef LCD_USING_I2C
+#define LCD_USING_I2C (0)
+#endif
 
 // #define LCD_DATA0_DDR (DDRD)
 // #define LCD_DATA1_DDR (DDRD)
@@ -64,6 +114,246 @@
 #define LCD_RS_PIN (1)
 #define LCD_ENABLE_PIN (0)
 
+// RS-485 transceiver driver enable for bus mode (BUS_MODE), high while this unit is transmitting
+// there is no free pin with the GPIO LCD wiring, so without the I2C LCD an auto-direction transceiver is needed
+#if LCD_USING_I2C
+#define BUS_DE_DDR (DDRD)
+#define BUS_DE_PORT (PORTD)
+#define BUS_DE_PIN (6)
+#endif
+
+// LED matrix, the columns are driven high and the rows pulled low to turn an LED on
+// each row and column is given as the bits it uses in PORTB, PORTC and PORTD
+#define MATRIX_COLUMNS (5)
+#define MATRIX_ROW1_PORTB (0)
+#define MATRIX_ROW1_PORTD (1 << 2)
+#define MATRIX_ROW2_PORTB (0)
+#define MATRIX_ROW2_PORTD (1 << 3)
+#define MATRIX_ROW3_PORTB (1 << 2)
+#define MATRIX_ROW3_PORTD (0)
+#define MATRIX_ROW4_PORTB (1 << 4)
+#define MATRIX_ROW4_PORTD (0)
+
+#define MATRIX_COL1_PORTC (1 << 1)
+#define MATRIX_COL1_PORTD (0)
+#define MATRIX_COL2_PORTC (1 << 2)
+#define MATRIX_COL2_PORTD (0)
+#define MATRIX_COL3_PORTC (1 << 3)
+#define MATRIX_COL3_PORTD (0)
+#if LCD_USING_I2C
+// PC4 and PC5 are needed for SDA and SCL so the last two columns move to the freed LCD pins PD4 and PD5
+#define MATRIX_COL4_PORTC (0)
+#define MATRIX_COL4_PORTD (1 << 4)
+#define MATRIX_COL5_PORTC (0)
+#define MATRIX_COL5_PORTD (1 << 5)
+#else
+#define MATRIX_COL4_PORTC (1 << 4)
+#define MATRIX_COL4_PORTD (0)
+#define MATRIX_COL5_PORTC (1 << 5)
+#define MATRIX_COL5_PORTD (0)
+#endif
+
+// masks generated from the definitions above
+#define MATRIX_ROWS_PORTB_MASK (MATRIX_ROW1_PORTB | MATRIX_ROW2_PORTB | MATRIX_ROW3_PORTB | MATRIX_ROW4_PORTB)
+#define MATRIX_ROWS_PORTD_MASK (MATRIX_ROW1_PORTD | MATRIX_ROW2_PORTD | MATRIX_ROW3_PORTD | MATRIX_ROW4_PORTD)
+#define MATRIX_COLUMNS_PORTC_MASK (MATRIX_COL1_PORTC | MATRIX_COL2_PORTC | MATRIX_COL3_PORTC | MATRIX_COL4_PORTC | MATRIX_COL5_PORTC)
+#define MATRIX_COLUMNS_PORTD_MASK (MATRIX_COL1_PORTD | MATRIX_COL2_PORTD | MATRIX_COL3_PORTD | MATRIX_COL4_PORTD | MATRIX_COL5_PORTD)
+// turn a bitmap of lit rows (bit 0 = row 1) into the bits to pull low in PORTB/PORTD
+#define MATRIX_ROWS_PORTB(rows) (((rows) & 1 ? MATRIX_ROW1_PORTB : 0) | ((rows) & 2 ? MATRIX_ROW2_PORTB : 0) | \
+	((rows) & 4 ? MATRIX_ROW3_PORTB : 0) | ((rows) & 8 ? MATRIX_ROW4_PORTB : 0))
+#define MATRIX_ROWS_PORTD(rows) (((rows) & 1 ? MATRIX_ROW1_PORTD : 0) | ((rows) & 2 ? MATRIX_ROW2_PORTD : 0) | \
+	((rows) & 4 ? MATRIX_ROW3_PORTD : 0) | ((rows) & 8 ? MATRIX_ROW4_PORTD : 0))
+
+// headers
+#include <stdint.h>
+#include <avr/io.h> 
+#include <avr/interrupt.h>
+#include <util/delay.h>
+#include <util/atomic.h>
+#include <avr/wdt.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <string.h>
+#include <stdarg.h>
+
+// macro definitions
+#define SET_BIT(reg, pin)           (reg) |= (1 << (pin))
+#define SET_BITS(reg, mask)			(reg) |= mask
+#define CLEAR_BIT(reg, pin)         (reg) &= ~(1 << (pin))
+#define WRITE_BIT(reg, pin, value)  (reg) = (((reg) & ~(1 << (pin))) | ((value) << (pin)))
+#define BIT_VALUE(reg, pin)         (((reg) >> (pin)) & 1)
+#define BIT_IS_SET(reg, pin)        (BIT_VALUE((reg),(pin))==1)
+#define CLEAR_BITS(reg, mask)		(reg) &= ~mask 
+#define TOGGLE_BIT(reg, pin)	reg^= (1 << pin)
+// set or clear one bit depending on value, with a constant reg and pin this is a single sbi/cbi instruction
+// so it can't undo a change an ISR makes to the same port
+#define PUT_BIT(reg, pin, value)    do { if (value) { SET_BIT(reg, pin); } else { CLEAR_BIT(reg, pin); } } while (0)
+
+// constant definitions
+// UBRR rounded to the nearest value
+#define UBRR ((F_CPU + 8UL * BAUD_RATE) / (16UL * BAUD_RATE) - 1)
+// timer 1 counts at F_CPU / 1024
+#define TIMER1_ONE_SECOND (F_CPU / 1024)
+// where timer 1 starts counting from so the first countdown interrupt happens almost immediately
+#define TIMER1_START (TIMER1_ONE_SECOND * 5 / 6)
+// length of a timer 1 count in microseconds (64us at 16MHz), used to time the boot
+#define TIMER1_TICK_US (1024000000UL / F_CPU)
+
+// power on self test, the result of each check is printed at boot along with how long each part of the boot took
+#define POWER_ON_SELF_TEST (1)
+// set to 1 with TX wired to RX to check the UART as well (nothing else can be connected to the serial port)
+#define SELF_TEST_UART_LOOPBACK (0)
+// an ADC reading at either end of the range means the light sensor is disconnected or shorted
+#define SELF_TEST_ADC_MIN 1
+#define SELF_TEST_ADC_MAX 1022
+
+// events passed from the ISRs to the main loop
+#define EVENT_QUEUE_SIZE 8 // must be a power of two
+#define EVENT_NONE 0
+#define EVENT_BUTTON_PRESSED 1
+#define EVENT_COUNTDOWN_DONE 2
+#define EVENT_BUS_COMMAND 3
+#define EVENT_TICK 4 // a second of the countdown has gone, see countdown_update()
+
+// the watchdog resets the program if the tasks below stop checking in for this long
+// (longer than the 1 second between countdown interrupts)
+#define WATCHDOG_TIMEOUT WDTO_2S
+#define TASK_MAIN (1 << 0)
+#define TASK_DEBOUNCE (1 << 1)
+#define TASK_COUNTDOWN (1 << 2)
+
+// the light bulb brightness is kept as a level with PWM_DITHER_BITS more resolution than the 8 bit timer 2 PWM
+// the timer 2 overflow interrupt dithers between the two nearest compare values to make up the difference
+// level 0 is off and BULB_LEVEL(ocr) is the same brightness as a compare value of ocr without dithering
+#define PWM_DITHER_BITS (4)
+#define BULB_LEVEL(ocr) (((uint16_t)(ocr) + 1) << PWM_DITHER_BITS)
+#define BULB_LEVEL_MAX BULB_LEVEL(255)
+// set to 1 to record the longest the dithering interrupt takes (in timer 2 ticks of 8 cycles) and print it with
+// the goodnight message
+#define PWM_ISR_PROFILE (0)
+// set to 1 to record the longest the timer 0 interrupt is held up by other interrupts (in timer 0 ticks of
+// TIMER0_PRESCALER cycles)
+// and print it with the goodnight message
+#define TIMER0_LATENCY_PROFILE (0)
+
+#if PWM_DITHER_BITS > 8
+#error "PWM_DITHER_BITS can be at most 8"
+#endif
+
+// closed loop mode: a PI controller running off the light sensor adjusts the bulb to hold the total light level
+// (room + bulb) steady, instead of the brightness only being picked once when the button is pressed
+#ifndef CLOSED_LOOP_MODE
+#define CLOSED_LOOP_MODE (0)
+#endif
+#define CONTROL_DIVIDER (16)     // sample the light sensor and run the controller every 16 timer 0 overflows
+#define CONTROL_KP (64)          // proportional gain in 1/256ths of a compare value step per ADC count
+#define CONTROL_KI (8)           // integral gain in 1/256ths of a step per ADC count per sample
+#define CONTROL_SLEW (2)         // the most the compare value can change by in one sample, stops visible flicker
+#define CONTROL_FULL (256L << 8) // full brightness in 1/256ths of a compare value step
+#define CONTROL_SETTLE_MS (100)  // time for the bulb and sensor to settle before measuring the level to hold
+
+// give up on a time string with no closing quote if nothing more is received for this long
+#define RECEIVE_TIMEOUT_MS 10000UL
+// serial output is queued in a ring buffer and sent by the data register empty ISR
+#define UART_TX_BUFFER_SIZE 128 // must be a power of two
+// longest message that can be sent in one uart_printf()/uart_status() call
+#define UART_LINE_LENGTH 96
+
+// bus mode: set to 1 to run several nightlights on one shared half-duplex serial line (e.g. RS-485) instead of the
+// serial menu. Each unit has an ID in EEPROM and only acts on lines addressed to it ("@3 dim 600") or to every unit
+// ("@* dim 600"), and it only transmits in reply to a line addressed to it so replies can't collide
+#ifndef BUS_MODE
+#define BUS_MODE (0)
+#endif
+#define BUS_DEFAULT_ID 1     // used until an ID has been stored in EEPROM
+#define BUS_MAX_ID 247
+#define BUS_FRAME_LENGTH 24  // longest line that can be received, including the address
+
+// trace mode: set to 1 to record timestamped inputs and outputs over the serial port, interleaved with the normal
+// output, so a run can be replayed and compared (make replay, see test/replay.py). Each record is one line:
+//   ~<tick> <kind> <data>
+// where tick counts timer 0 overflows since reset (TRACE_TICK_US each, given by the V record at boot) and kind is
+//   V <format version> <tick length in us>  written once at boot
+//   R <byte>           serial byte received by the menu (decimal)
+//   A <reading>        ADC reading taken by read_adc()
+//   B <0|1>            raw button level changed (before debouncing), queued by the timer 0 ISR and written out by the
+//                      main loop with the tick it was seen at
+//   E <event>          event taken by the main loop (see EVENT_*)
+//   L <level>          bulb level (see BULB_LEVEL) whenever the compare value part of it changes
+//   S <x> <y> <text>   text written to the LCD
+//   C                  LCD cleared
+//   X <count>          B records dropped because the main loop didn't write them out before the queue filled up
+// lines that don't start with '~' are the normal serial output. The closed loop controller's ADC samples and
+// output, and the LCD bar graphs (which follow the level and countdown), aren't recorded
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED (0)
+#endif
+// trace replay (host builds only, needs TRACE_ENABLED): the serial bytes, ADC readings and button levels are taken
+// from the R, A and B records of a recorded trace instead of the hardware, through replay_byte(), replay_adc() and
+// replay_button() which the replay harness provides (see test/replay.c)
+#ifndef TRACE_REPLAY
+#define TRACE_REPLAY (0)
+#endif
+#define TRACE_FORMAT_VERSION 1
+#define TRACE_BUTTON_QUEUE_SIZE 8 // must be a power of two
+#define TRACE_TICK_US (TIMER0_PRESCALER * 256000UL / (F_CPU / 1000))
+
+#if TRACE_ENABLED && BUS_MODE
+#error "trace records would break the bus protocol"
+#endif
+#if TRACE_REPLAY && !TRACE_ENABLED
+#error "TRACE_REPLAY needs TRACE_ENABLED"
+#endif
+
+#if BUS_MODE && defined(BUS_DE_PIN)
+#define BUS_DRIVER_ENABLE (1)
+#else
+#define BUS_DRIVER_ENABLE (0)
+#endif
+
+// longest time that can be selected (99:59:59) and the space needed to type it in e.g. "1h30m" or "01:30:00"
+#define MAX_TIME (99UL * 3600 + 59 * 60 + 59)
+#define TIME_STRING_LENGTH 12
+
+// LCD bar graphs made from custom characters, character n (1 to 5) has its n left columns filled
+#define BAR_STEPS_PER_CELL 5
+#define BRIGHTNESS_BAR_CELLS 16
+#define PROGRESS_BAR_CELLS 7
+#define PROGRESS_BAR_X 9
+
+// LED matrix animations (frame tables below) shown while dimming and while on without dimming
+#define MATRIX_ANIMATION_DIMMING matrix_moon
+#define MATRIX_ANIMATION_ON matrix_breathing
+// frame durations are counted in timer 0 overflows
+#define MATRIX_MS(ms) ((uint16_t)((ms) * (F_CPU / 1000) / (TIMER0_PRESCALER * 256UL)))
+
+// LCD definitions copied from WK11 topic on LCDs (the pins are in the board definitions)
+
+// PCF8574 I2C backpack settings (used when LCD_USING_I2C is set)
+#define LCD_I2C_ADDRESS (0x27)
+#define LCD_I2C_CLOCK (100000UL)
+#define LCD_I2C_QUEUE_SIZE (64) // must be a power of two
+
+// the LCD needs 50ms from power up before it takes commands, counted by timer 1 from reset (see lcd_init)
+#define LCD_POWER_UP_TICKS (50000UL / TIMER1_TICK_US)
+
+// PCF8574 outputs used by the backpack, P4-P7 go to D4-D7
+#define LCD_I2C_RS (1 << 0)
+#define LCD_I2C_RW (1 << 1)
+#define LCD_I2C_ENABLE (1 << 2)
+#define LCD_I2C_BACKLIGHT (1 << 3)
+
+#if LCD_USING_I2C && !LCD_USING_4PIN_MODE
+#error "the I2C backpack only supports 4 pin mode"
+#endif
+
+// optional parts of the LCD library, set to 1 to compile them in (the nightlight doesn't use any of them)
+#define LCD_USING_EXTRA_WRITES (0)    // lcd_write_char() and lcd_home()
+#define LCD_USING_DISPLAY_CONTROL (0) // lcd_noDisplay(), lcd_cursor()/lcd_noCursor() and lcd_blink()/lcd_noBlink()
+#define LCD_USING_SCROLLING (0)       // scrollDisplayLeft() and scrollDisplayRight()
+#define LCD_USING_TEXT_DIRECTION (0)  // lcd_leftToRight()/lcd_rightToLeft() and lcd_autoscroll()/lcd_noAutoscroll()
+
+
 
 //DATASHEET: https://s3-us-west-1.amazonaws.com/123d-circuits-datasheets/uploads%2F1431564901240-mni4g6oo875bfbt9-6492779e35179defaf4482c7ac4f9915%2FLCD-WH1602B-TMI.pdf
 
@@ -107,25 +397,33 @@
 
 void lcd_init(void);
 void lcd_write_string(uint8_t x, uint8_t y, char string[]);
-void lcd_write_char(uint8_t x, uint8_t y, char val);
 void lcd_clear(void);
+#if LCD_USING_EXTRA_WRITES
+void lcd_write_char(uint8_t x, uint8_t y, char val);
 void lcd_home(void);
+#endif
 
 void lcd_createChar(uint8_t, uint8_t[]);
 void lcd_setCursor(uint8_t, uint8_t); 
 
-void lcd_noDisplay(void);
 void lcd_display(void);
+#if LCD_USING_DISPLAY_CONTROL
+void lcd_noDisplay(void);
 void lcd_noBlink(void);
 void lcd_blink(void);
 void lcd_noCursor(void);
 void lcd_cursor(void);
+#endif
+#if LCD_USING_TEXT_DIRECTION
 void lcd_leftToRight(void);
 void lcd_rightToLeft(void);
 void lcd_autoscroll(void);
 void lcd_noAutoscroll(void);
+#endif
+#if LCD_USING_SCROLLING
 void scrollDisplayLeft(void);
 void scrollDisplayRight(void);
+#endif
 
 size_t lcd_write(uint8_t);
 void lcd_command(uint8_t);
@@ -134,75 +432,438 @@ void lcd_send(uint8_t, uint8_t);
 void lcd_write4bits(uint8_t);
 void lcd_write8bits(uint8_t);
 void lcd_pulseEnable(void);
+void lcd_flush(void);
+#if LCD_USING_I2C
+void lcd_i2c_init(void);
+void lcd_i2c_queue(uint8_t);
+static inline void lcd_i2c_service(void);
+#endif
 
 uint8_t _lcd_displayfunction;
 uint8_t _lcd_displaycontrol;
 uint8_t _lcd_displaymode;
 
+#if LCD_USING_I2C
+// bytes waiting to be sent to the PCF8574, queued by lcd_write4bits and sent by the TWI interrupt
+volatile uint8_t _lcd_i2c_queue[LCD_I2C_QUEUE_SIZE];
+volatile uint8_t _lcd_i2c_head = 0;
+volatile uint8_t _lcd_i2c_tail = 0;
+volatile uint8_t _lcd_i2c_busy = 0;
+// transfers the PCF8574 didn't acknowledge (checked by the self test)
+volatile uint8_t _lcd_i2c_errors = 0;
+// the RS level to send with the next nibbles (set by lcd_send)
+uint8_t _lcd_i2c_rs = 0;
+#endif
+
 // function declarations
 void uart_setup();
-void uart_put_byte(unsigned char data);
+void uart_receive_enable(uint8_t on);
 int uart_get_byte(unsigned char *data);
-void uart_transmit_string(char str[]);
+void uart_printf(const char *format, ...);
+uint8_t uart_status(const char *format, ...);
+void uart_vprintf(const char *format, va_list args);
+uint8_t uart_format(char line[], uint8_t size, const char *format, va_list args);
+uint8_t uart_send_line(const char line[], uint8_t length);
+void uart_send_line_wait(const char line[], uint8_t length);
 void uart_receive_string(char buffer[], int buff_len);
-int string_to_int(char buffer[]);
-void reverse(char * str, int len);
-void int_to_string(int x, char str[]);
+#if TRACE_ENABLED
+void trace(char kind, const char *format, ...);
+void trace_poll(void);
+uint8_t trace_format(char line[], uint8_t size, const char *format, ...);
+#endif
+#if TRACE_REPLAY
+// provided by the replay harness: the next byte received by 'tick' (returns 0 if there isn't one yet), the next ADC
+// reading and the button level at 'tick'
+uint8_t replay_byte(uint32_t tick, unsigned char *data);
+uint16_t replay_adc(void);
+uint8_t replay_button(uint32_t tick);
+#endif
+#if BUS_MODE
+uint8_t bus_parse_address(const char frame[]);
+uint8_t bus_command(void);
+void bus_start(void);
+void bus_reply(const char *format, ...);
+#endif
+uint8_t string_to_time(char buffer[]);
+void time_to_string(uint32_t seconds, char str[]);
+uint8_t countdown_decrement(char str[]);
 void menu(void);
 void process(void);
 void setup(void);
+#if POWER_ON_SELF_TEST
+uint8_t self_test(void);
+uint8_t self_test_result(const char *name, uint8_t ok);
+#endif
 void setup_Timer1(void);
 void setup_Timer0(void);
 void setup_Timer2(void);
-void dim_bulb(int time);
+void dim_bulb(uint32_t time);
+void fade_bulb(uint32_t time, uint8_t ocr, uint16_t count);
+void hold_bulb(uint8_t ocr);
+uint8_t initial_ocr(void);
+void start_countdown(uint32_t elapsed);
+uint8_t resume_fade(void);
+void save_fade(uint32_t time, uint8_t ocr, uint16_t count);
+uint8_t fade_checksum(void);
+void watchdog_checkpoint(void);
+void set_bulb(uint16_t level);
+void write_bulb_level(uint16_t level);
+#if CLOSED_LOOP_MODE
+void start_control(uint16_t level);
+void stop_control(void);
+uint16_t control_step(uint16_t target, uint16_t reading);
+#endif
+void get_reset_cause(void) __attribute__((naked, used, section(".init3")));
 void setup_adc(void);
 uint16_t read_adc(void);
 void setup_lcd(void);
 void clear(void);
-uint8_t my_delay(int);
+uint8_t my_delay(uint32_t);
 void bulb_on(void);
 void setup_led_matrix(void);
+void matrix_start(void);
+void matrix_animate(void);
+void matrix_load(uint8_t frame);
+void matrix_stop(void);
 void lcd_write_brightness(void);
+void lcd_write_bar(uint8_t x, uint8_t y, uint8_t cells, uint32_t value, uint32_t max, uint8_t shown[]);
+void lcd_write_progress(uint32_t time_remaining);
+static inline void matrix_columns_off(void);
+void end_process(uint8_t event);
+static inline uint8_t event_post(uint8_t event);
+void event_flush(void);
+uint8_t event_get(void);
+uint8_t event_next(void);
+void countdown_update(void);
 
 // global variables
-int time_int;
-char time_string[6] = {'\0'}; 
-char brightness_string[10] = {'\0'};
+// time_int, time_selected and status are only written by the main loop (while the timer 1 compare interrupt is off)
+// elapsed_time is only written by the timer 1 ISR, apart from being reset by clear() once the ISR is disabled
+volatile uint32_t time_int;
+char time_string[TIME_STRING_LENGTH] = {'\0'}; 
+// time remaining as "hh:mm:ss", set before the countdown starts then only updated by countdown_update()
+char countdown_string[9] = "00:00:00";
+// countdown_update() state: seconds taken off countdown_string so far, the elapsed_time it last showed and the first
+// character of countdown_string that needs redrawing
+uint32_t countdown_shown = 0;
+uint32_t countdown_drawn = 0;
+uint8_t countdown_changed = 0;
+// the characters currently shown in each bar graph cell so only the cells that change are redrawn (0 = unknown)
+uint8_t brightness_bar[BRIGHTNESS_BAR_CELLS];
+uint8_t progress_bar[PROGRESS_BAR_CELLS];
 uint16_t brightness = 0;
-int time_selected;
-volatile int elapsed_time = 0;
+volatile uint8_t time_selected;
+volatile uint32_t elapsed_time = 0;
 volatile uint8_t bit_count = 0;
 volatile uint8_t switch_state = 0;
-uint8_t prevState = 0;
-volatile uint8_t matrix_column_count = 1;
-uint8_t status = 0;
+volatile uint8_t matrix_column = 0;
+volatile uint8_t status = 0;
+
+// single-producer/single-consumer ring of events
+// the head is only written by the ISRs that post events (timer 0, timer 1 and the bus receive ISR), which all run with
+// interrupts off so they can't interrupt each other and act as one producer, and the tail only by the main loop
+// (the ADC ISR does let other interrupts in but never posts)
+volatile uint8_t event_queue[EVENT_QUEUE_SIZE];
+volatile uint8_t event_head = 0;
+volatile uint8_t event_tail = 0;
+// 1 while an EVENT_TICK is in the queue, the timer 1 ISR only posts another once it has been taken so a held up main
+// loop can't fill the queue with ticks and lose the events behind them (countdown_update() catches up anyway)
+volatile uint8_t tick_queued = 0;
+
+// serial output ring, the head is only moved by uart_send_line() (which is only called from the main loop) and the tail
+// only by the data register empty ISR
+volatile char uart_tx_buffer[UART_TX_BUFFER_SIZE];
+volatile uint8_t uart_tx_head = 0;
+volatile uint8_t uart_tx_tail = 0;
+
+#if BUS_MODE
+// this unit's address on the bus
+uint8_t bus_id_eeprom EEMEM = BUS_DEFAULT_ID;
+uint8_t bus_id;
+// the line being received, only used by the receive ISR (BUS_FRAME_LENGTH while skipping a line that is too long)
+char bus_frame[BUS_FRAME_LENGTH];
+uint8_t bus_frame_length = 0;
+// a command for this unit with the address taken off, written by the receive ISR while bus_command_ready is clear
+// and then left alone until the main loop clears it
+char bus_command_text[BUS_FRAME_LENGTH];
+char *bus_argument = NULL;
+volatile uint8_t bus_command_ready = 0;
+// 1 if the command was addressed to this unit (so it gets a reply), 0 if it was broadcast
+uint8_t bus_addressed = 0;
+#endif
+
+// brightness of the light bulb (see BULB_LEVEL), turned into compare values by the timer 2 overflow ISR
+volatile uint16_t bulb_level = 0;
+// how far the dithered output is behind the level, only used by the timer 2 overflow ISR
+uint8_t dither_error = 0;
+#if PWM_ISR_PROFILE
+volatile uint8_t pwm_isr_ticks_max = 0;
+#endif
+#if TIMER0_LATENCY_PROFILE
+volatile uint8_t timer0_latency_max = 0;
+#endif
+
+#if CLOSED_LOOP_MODE
+// controller state, only changed by the ADC ISR while control_enabled is set
+volatile uint8_t control_enabled = 0;
+volatile uint8_t control_divider = 0;
+volatile uint16_t light_target = 0;
+int32_t control_integral = 0;
+// the bulb level from the last step, for the slew limit
+uint16_t control_output = 0;
+// sensor readings without the bulb and with the bulb at control_level, used to scale the target as the bulb fades
+uint16_t light_ambient = 0;
+uint16_t light_reference = 0;
+uint16_t control_level = 0;
+#endif
+
+#if TRACE_ENABLED
+// timer 0 overflows since reset, the trace timestamps
+volatile uint32_t trace_ticks = 0;
+// last raw button level, only used by the timer 0 ISR
+uint8_t trace_button = 0;
+// button level changes (tick and level) queued by the timer 0 ISR for trace_poll(), formatting them in the ISR would
+// hold up the matrix and debouncing. The ISR only writes an entry and then the head, trace_poll() only moves the tail
+volatile uint32_t trace_button_ticks[TRACE_BUTTON_QUEUE_SIZE];
+volatile uint8_t trace_button_levels[TRACE_BUTTON_QUEUE_SIZE];
+volatile uint8_t trace_button_head = 0;
+volatile uint8_t trace_button_tail = 0;
+// compare value part of the last bulb level recorded
+uint16_t trace_duty = 0;
+// B records dropped because the queue was full, reported by the next trace_poll()
+volatile uint8_t trace_dropped = 0;
+#endif
+
+// each task sets its bit as it runs, see watchdog_checkpoint()
+volatile uint8_t tasks_alive = 0;
+// MCUSR from the last reset, along with the fade progress, kept in .noinit so a reset doesn't clear them
+uint8_t reset_cause __attribute__((section(".noinit")));
+struct {
+	uint32_t time;
+	uint8_t ocr;
+	uint16_t count;
+#if CLOSED_LOOP_MODE
+	uint16_t ambient; // light_ambient, the bulb is already on when the fade is resumed so it can't be measured again
+#endif
+	uint8_t check; // must be last, see fade_checksum()
+} saved_fade __attribute__((section(".noinit")));
+
+// LED matrix animation frames, kept in program memory
+struct matrix_frame {
+	uint8_t rows[MATRIX_COLUMNS]; // the lit rows of each column (bit 0 = row 1)
+	uint16_t duration;            // how long to show the frame (see MATRIX_MS), 0 to show it until the animation changes
+};
+struct matrix_animation {
+	const struct matrix_frame *frames;
+	uint8_t count;
+	// 1 to pick the frame from the fraction of the countdown left instead of the durations, from the last frame at
+	// the start down to frame 0 at the end
+	uint8_t follows_progress;
+};
+
+// the original star
+const struct matrix_frame matrix_star_frames[] PROGMEM = {
+	{{0b1010, 0b0110, 0b0111, 0b0110, 0b1010}, 0},
+};
+// the star shrinking to its centre and back
+const struct matrix_frame matrix_breathing_frames[] PROGMEM = {
+	{{0b1010, 0b0110, 0b0111, 0b0110, 0b1010}, MATRIX_MS(1200)},
+	{{0b0000, 0b0110, 0b0111, 0b0110, 0b0000}, MATRIX_MS(250)},
+	{{0b0000, 0b0000, 0b0010, 0b0000, 0b0000}, MATRIX_MS(500)},
+	{{0b0000, 0b0110, 0b0111, 0b0110, 0b0000}, MATRIX_MS(250)},
+};
+// a bar of columns shrinking from the right as the countdown runs down
+const struct matrix_frame matrix_progress_frames[] PROGMEM = {
+	{{0b0000, 0b0000, 0b0000, 0b0000, 0b0000}, 0},
+	{{0b1111, 0b0000, 0b0000, 0b0000, 0b0000}, 0},
+	{{0b1111, 0b1111, 0b0000, 0b0000, 0b0000}, 0},
+	{{0b1111, 0b1111, 0b1111, 0b0000, 0b0000}, 0},
+	{{0b1111, 0b1111, 0b1111, 0b1111, 0b0000}, 0},
+	{{0b1111, 0b1111, 0b1111, 0b1111, 0b1111}, 0},
+};
+// a full moon waning to a new moon as the countdown runs down
+const struct matrix_frame matrix_moon_frames[] PROGMEM = {
+	{{0b0000, 0b0000, 0b0000, 0b0000, 0b0000}, 0},
+	{{0b0110, 0b1001, 0b0000, 0b0000, 0b0000}, 0},
+	{{0b0110, 0b1111, 0b0000, 0b0000, 0b0000}, 0},
+	{{0b0110, 0b1111, 0b1111, 0b0000, 0b0000}, 0},
+	{{0b0110, 0b1111, 0b1111, 0b0110, 0b0000}, 0},
+	{{0b0110, 0b1111, 0b1111, 0b1111, 0b0110}, 0},
+};
+const struct matrix_animation matrix_star = {matrix_star_frames, 1, 0};
+const struct matrix_animation matrix_breathing = {matrix_breathing_frames, 4, 0};
+const struct matrix_animation matrix_progress = {matrix_progress_frames, 6, 1};
+const struct matrix_animation matrix_moon = {matrix_moon_frames, 6, 1};
+
+// the frame on the LED matrix as the rows to pull low for each column. The ISR shows buffer matrix_front while
+// matrix_load() draws into the other one, which the ISR swaps in at column 0 so a frame is never shown half drawn
+volatile uint8_t matrix_buffer_portb[2][MATRIX_COLUMNS];
+volatile uint8_t matrix_buffer_portd[2][MATRIX_COLUMNS];
+volatile uint8_t matrix_front = 0;
+volatile uint8_t matrix_swap_pending = 0;
+// 1 while the ISR is scanning the matrix, see matrix_start() and matrix_stop()
+volatile uint8_t matrix_enabled = 0;
+// timer 0 overflows, the time base for the animations
+volatile uint16_t matrix_ticks = 0;
+// the animation being shown, only used by the main loop
+const struct matrix_animation *matrix_animation = &matrix_star;
+uint8_t matrix_frame = 0;
+uint16_t matrix_frame_start = 0;
+// the column pins to drive high for each column
+const uint8_t matrix_columns_portc[MATRIX_COLUMNS] = {
+	MATRIX_COL1_PORTC, MATRIX_COL2_PORTC, MATRIX_COL3_PORTC, MATRIX_COL4_PORTC, MATRIX_COL5_PORTC
+};
+const uint8_t matrix_columns_portd[MATRIX_COLUMNS] = {
+	MATRIX_COL1_PORTD, MATRIX_COL2_PORTD, MATRIX_COL3_PORTD, MATRIX_COL4_PORTD, MATRIX_COL5_PORTD
+};
 
 
 //**** SETUP FUNCTIONS ****//
 
+// runs before main() to record why the program was reset, the watchdog has to be turned off straight away
+// after a watchdog reset or it would keep resetting
+// A bootloader reads and clears MCUSR before it starts the program. Newer optiboot versions pass it on in r2, so
+// that is used when MCUSR is empty (every reset sets at least one flag). The optiboot on a stock UNO doesn't, which
+// leaves reset_cause without WDRF and the fade isn't resumed: flash over ISP (make builds a plain image for that) or
+// update the bootloader. Whatever else r2 holds can't resume a fade, saved_fade still has to pass its checksum
+void get_reset_cause(void) {
+	reset_cause = MCUSR;
+#ifdef __AVR__
+	if (reset_cause == 0) {
+		__asm__ __volatile__ ("mov %0, r2" : "=r" (reset_cause));
+	}
+#endif
+	MCUSR = 0;
+	wdt_disable();
+}
+
 // setup
 void setup(void) {
+	// timer 1 goes first so it counts from reset, it times the boot and the LCD power up wait
+	setup_Timer1();
 	// PIN for lightbulb to output
-	SET_BIT(DDRB, 3);
+	SET_BIT(BULB_DDR, BULB_PIN);
 	// PIN for switch button to input 
-	CLEAR_BIT(DDRB, 5);
+	CLEAR_BIT(BUTTON_DDR, BUTTON_PIN);
 	uart_setup();
 	setup_adc();
-	setup_lcd();
 	setup_led_matrix();
-	setup_Timer1();
 	setup_Timer0();
 	setup_Timer2();
 	// enable interrupts
 	sei();
-	
+	uint16_t setup_done = TCNT1;
+#if TRACE_ENABLED
+	trace('V', PSTR("%u %lu"), TRACE_FORMAT_VERSION, TRACE_TICK_US);
+#endif
+#if POWER_ON_SELF_TEST
+	uint8_t failed = self_test();
+#endif
+	uint16_t self_test_done = TCNT1;
+	// the LCD goes last as it has to wait for its power up anyway
+	setup_lcd();
+	uint16_t lcd_done = TCNT1;
+#if POWER_ON_SELF_TEST
+#if LCD_USING_I2C
+	// the backpack acknowledging everything sent by lcd_init() is as close to a readback as the write-only transport gets
+	failed += self_test_result(PSTR("LCD"), _lcd_i2c_errors == 0);
+#else
+	uart_printf(PSTR("Self test: LCD not checked (R/W is wired to ground so it can't be read back)\n"));
+#endif
+	if (failed) {
+		lcd_write_string(0, 1, "Self test failed");
+	}
+#endif
+	uart_printf(PSTR("Boot (us): setup %lu, self test %lu, LCD %lu, ready %lu\n"),
+		setup_done * TIMER1_TICK_US, (self_test_done - setup_done) * TIMER1_TICK_US,
+		(lcd_done - self_test_done) * TIMER1_TICK_US, lcd_done * TIMER1_TICK_US);
+	// reset if the program stops running (see watchdog_checkpoint)
+	wdt_enable(WATCHDOG_TIMEOUT);
 }
 
+#if POWER_ON_SELF_TEST
+// quick checks of the peripherals at power on (the LCD is checked once it has been set up)
+// prints the result of each check and returns how many failed
+uint8_t self_test(void) {
+	uint8_t failed = 0;
+	uint8_t ok;
+#if SELF_TEST_UART_LOOPBACK
+	// UART: every byte sent should come straight back, this goes first so nothing else is being sent
+	ok = 1;
+	// keep the receive ISR (in bus mode) out of the way
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		const uint8_t patterns[] = {0x55, 0xAA};
+		for (uint8_t i = 0; i < sizeof(patterns); i++) {
+			// throw away anything already received
+			while (BIT_IS_SET(UCSR0A, RXC0)) {
+				(void)UDR0;
+			}
+			while (!BIT_IS_SET(UCSR0A, UDRE0));
+			UDR0 = patterns[i];
+			// a byte takes under 0.3ms at 38400 baud
+			uint8_t wait = 0;
+			while (!BIT_IS_SET(UCSR0A, RXC0) && ++wait < 100) {
+				_delay_us(10);
+			}
+			if (!BIT_IS_SET(UCSR0A, RXC0) || UDR0 != patterns[i]) {
+				ok = 0;
+			}
+		}
+	}
+	failed += self_test_result(PSTR("UART loopback"), ok);
+#endif
+	// ADC
+	uint16_t reading = read_adc();
+	failed += self_test_result(PSTR("ADC"), reading >= SELF_TEST_ADC_MIN && reading <= SELF_TEST_ADC_MAX);
+	// PWM: at level 0 the output is disconnected (low) and at the maximum it is high for the whole cycle, reading the
+	// pin back checks timer 2, the dithering ISR and the pin (the bulb is on for 1ms, too short to see)
+	write_bulb_level(0);
+	_delay_us(1000);
+	uint8_t low = BIT_IS_SET(BULB_INPUT, BULB_PIN);
+	write_bulb_level(BULB_LEVEL_MAX);
+	// a few PWM cycles for the new compare value to take effect
+	_delay_us(1000);
+	uint8_t high = BIT_IS_SET(BULB_INPUT, BULB_PIN);
+	write_bulb_level(0);
+	failed += self_test_result(PSTR("PWM"), !low && high);
+	// LED matrix: drive one column at a time with the rows high (so nothing lights) and check only that column reads
+	// back high, which finds columns that are shorted together or stuck
+	ok = 1;
+	for (uint8_t column = 0; column < MATRIX_COLUMNS; column++) {
+		uint8_t columns_c;
+		uint8_t columns_d;
+		// the timer 0 ISR turns the columns off on every overflow
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			SET_BITS(PORTB, MATRIX_ROWS_PORTB_MASK);
+			SET_BITS(PORTD, MATRIX_ROWS_PORTD_MASK);
+			SET_BITS(PORTC, matrix_columns_portc[column]);
+			SET_BITS(PORTD, matrix_columns_portd[column]);
+			// let the pins settle and get through the input synchroniser
+			_delay_us(5);
+			columns_c = PINC & MATRIX_COLUMNS_PORTC_MASK;
+			columns_d = PIND & MATRIX_COLUMNS_PORTD_MASK;
+			matrix_columns_off();
+		}
+		if (columns_c != matrix_columns_portc[column] || columns_d != matrix_columns_portd[column]) {
+			ok = 0;
+		}
+	}
+	failed += self_test_result(PSTR("LED matrix"), ok);
+	return failed;
+}
+
+// print the result of one self test check, returns 1 if it failed
+uint8_t self_test_result(const char *name, uint8_t ok) {
+	uart_printf(PSTR("Self test: %S %S\n"), name, ok ? PSTR("ok") : PSTR("FAILED"));
+	return !ok;
+}
+#endif
+
 // setup Timer 0 (used for debouncing button)
 void setup_Timer0(void){
-	// set prescaler to 256
-	CLEAR_BITS(TCCR0B, (1 << CS00 | 1 << CS01));
-	SET_BITS(TCCR0B, CS02);
+	// set prescaler (see the board definitions)
+	CLEAR_BITS(TCCR0B, (1 << CS00 | 1 << CS01 | 1 << CS02));
+	SET_BITS(TCCR0B, TIMER0_CLOCK_SELECT);
 	// enable timer overflow interrupt for timer 0
 	SET_BIT(TIMSK0, TOIE0);
 }
@@ -216,8 +877,7 @@ void setup_Timer1(void) {
 	TCCR1A = 0;
 	//OCR = time x f_cpu / prescaler value
 	// compare register value set at (every 1 second)
-	OCR1AH = (uint8_t)(15625 >> 8);
-	OCR1AL = (uint8_t)(15625);
+	OCR1A = TIMER1_ONE_SECOND;
 }
 
 
@@ -233,12 +893,20 @@ void setup_Timer2(void) {
 	// set WGM to fast PWM and Top value to 255
 	mask =  1 << WGM20 | 1 << WGM21;
 	SET_BITS(TCCR2A, mask);
+	// enable timer overflow interrupt for timer 2 (dithering)
+	SET_BIT(TIMSK2, TOIE2);
 }
 
 // setup LCD
 void setup_lcd(void) {
   // set up the LCD in 4-pin or 8-pin mode
   lcd_init();
+  // load the bar graph characters into CGRAM locations 1 to 5
+  uint8_t charmap[8];
+  for (uint8_t columns = 1; columns <= BAR_STEPS_PER_CELL; columns++) {
+    memset(charmap, (0x1F << (BAR_STEPS_PER_CELL - columns)) & 0x1F, sizeof(charmap));
+    lcd_createChar(columns, charmap);
+  }
 
 }
 
@@ -265,13 +933,38 @@ void uart_setup(void) {
 	SET_BITS(UCSR0C, ( 1 << UCSZ00 | 1 << UCSZ01 | 1 << UCSZ02));
 	// no parity + 1 stop bit ~ don't actually need to clear these
 	 CLEAR_BITS(UCSR0C, ( 1 << UPM01 | 1 << UPM00));
+#if BUS_MODE
+	// commands are collected by the receive interrupt instead of the menu
+	SET_BIT(UCSR0B, RXCIE0);
+#if BUS_DRIVER_ENABLE
+	SET_BIT(BUS_DE_DDR, BUS_DE_PIN);
+#endif
+	bus_id = eeprom_read_byte(&bus_id_eeprom);
+	if (bus_id == 0 || bus_id > BUS_MAX_ID) {
+		bus_id = BUS_DEFAULT_ID;
+	}
+#endif
+}
+
+// switch the uart receiver on or off
+// UCSR0B is out of reach of sbi/cbi, so this is a load and a store, and the data register empty ISR clears UDRIE0 in
+// between if the transmit ring empties: writing back the old UDRIE0 would start it again on an empty ring
+void uart_receive_enable(uint8_t on) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (on) {
+			SET_BIT(UCSR0B, RXEN0);
+		}
+		else {
+			CLEAR_BIT(UCSR0B, RXEN0);
+		}
+	}
 }
 
 // setup led matrix (set all the row and column pins to output)
 void setup_led_matrix(void) {
-	SET_BITS(DDRC, (1 << 1 | 1 << 2 | 1 << 3 | 1 << 4 | 1 << 5));
-	SET_BITS(DDRD, (1 << 2 | 1 << 3));
-	SET_BITS(DDRB, (1 << 2 | 1 << 4));
+	SET_BITS(DDRC, MATRIX_COLUMNS_PORTC_MASK);
+	SET_BITS(DDRD, (MATRIX_ROWS_PORTD_MASK | MATRIX_COLUMNS_PORTD_MASK));
+	SET_BITS(DDRB, MATRIX_ROWS_PORTB_MASK);
 }
 
 //**** PROCESSES ****//
@@ -279,259 +972,573 @@ void setup_led_matrix(void) {
 // main function
 int main() {
 	setup();
-	_delay_ms(200);
-	// program waits for user input via serial input
-	menu();
+#if BUS_MODE
+	// carry on with a fade that was interrupted by a reset, otherwise wait for a command from the bus
+	resume_fade();
+#else
+	// carry on with a fade that was interrupted by a reset, otherwise the program waits for user input via serial input
+	if (!resume_fade() || status == 0) {
+		menu();
+	}
+#endif
 	while (1) {	
-		// checks if the switch state has changed
-		if (switch_state != prevState) {
-			prevState = switch_state;
-			// checks if the button is detected as pressed
-			if (switch_state == 1 ) {
-					// small delay to prevent registering 2 instances of the switch being high 
-					// and ending the process function early
-					_delay_ms(300);
-					lcd_clear();
-					process();
-			}
-        }
+		watchdog_checkpoint();
+#if TRACE_ENABLED
+		trace_poll();
+#endif
+		matrix_animate();
+		uint8_t event = event_next();
+		// a button press starts the process, each press is only posted once by the debouncing ISR
+		if (event == EVENT_BUTTON_PRESSED) {
+			lcd_clear();
+			process();
+		}
+		// the countdown can finish after the bulb has already dimmed to 0
+		else if (event == EVENT_COUNTDOWN_DONE || event == EVENT_BUS_COMMAND) {
+			end_process(event);
+		}
+#if BUS_MODE
+		// a bus command (which may have stopped the process above) is carried out once the light has been cleared
+		if (bus_command_ready && status == 0) {
+			bus_start();
+		}
+#else
+		// once the process has been cleared return back to the menu (serial I/O)
+		if (event != EVENT_NONE && status == 0) {
+			menu();
+		}
+#endif
 	}
 	return 0;
 }
-
 // menu serial I/O
 void menu(void) {
 	lcd_write_string(0, 0, "Enter a time");
-	uart_transmit_string("Please enter the amount of time: ");
-	uart_receive_string(time_string, 6);
-	time_selected = string_to_int(time_string);
+	uart_printf(PSTR("Please enter the amount of time: "));
+	uart_receive_string(time_string, TIME_STRING_LENGTH);
+	time_selected = string_to_time(time_string);
 	_delay_ms(10);
-	int_to_string(time_int, time_string );
-	// if the string to int function returns true meaning the user has entered a number value
+	// if the string to time function returns true meaning the user has entered a valid time
 	if(time_selected) {
-		// output the value the user sent 
-		int_to_string(time_int, time_string);
-		uart_transmit_string(time_string);
+		// output the value the user sent as hh:mm:ss
+		time_to_string(time_int, time_string);
+		uart_printf(PSTR("%s\n"), time_string);
 	}
 	else {
 		// indicate that not time was selected
-		uart_transmit_string("No time selected: night light will remain on indefinitely.");
+		uart_printf(PSTR("No time selected: night light will remain on indefinitely.\n"));
 		time_selected = 0;
 	}
-	uart_put_byte('\n');
 	lcd_clear();
 	_delay_ms(5);
 	// disable uart receive temporarily 
-	CLEAR_BIT(UCSR0B, RXEN0);
+	uart_receive_enable(0);
 	lcd_write_string(0,0, "Press button");
-	uart_transmit_string("Press button to start");
-	uart_put_byte('\n');
+	uart_printf(PSTR("Press button to start\n"));
+	// ignore any button presses made while waiting for the serial input
+	event_flush();
 }
 
 // processes that occur after user inputs via menu/serial console
 void process(void) {
 	_delay_ms(5);
-	status = 1;
+	start_countdown(0);
 	if (time_selected) {
-		_delay_ms(5);
-		// activate countdown ISR and set the counter to almost the compare value to trigger interrupt almost immediately
-		SET_BIT(TIMSK1, OCIE1A);
-		TCNT1 = 13000;
 		// run the dim bulb function to dim the light bulb over the period of time selected
 		dim_bulb(time_int);
 	}
 	else {
-		SET_BIT(TIMSK1, OCIE1A);
-		TCNT1 = 13000;
 		// run the bulb on function to turn on the light bulb *no dimming 
 		bulb_on();
 	}
 }
 
-// turn on light bulb and dim it over time
-void dim_bulb(int time) {
-	uint8_t count = 1;
-	int ocr;
+// start the countdown ISR with 'elapsed' seconds of the selected time already gone
+void start_countdown(uint32_t elapsed) {
+	matrix_start();
+	status = 1;
+	// the LCD has just been cleared so every bar graph cell needs drawing
+	memset(brightness_bar, 0, sizeof(brightness_bar));
+	memset(progress_bar, 0, sizeof(progress_bar));
+	time_to_string(time_int - elapsed, countdown_string);
+	countdown_shown = elapsed;
+	countdown_drawn = elapsed;
+	countdown_changed = 0;
+	// activate countdown ISR and set the counter to almost the compare value to trigger interrupt almost immediately
+	// (16-bit timer register writes must not be interrupted)
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		elapsed_time = elapsed;
+		TCNT1 = TIMER1_START;
+		SET_BIT(TIMSK1, OCIE1A);
+	}
+}
+
+// pick the starting compare value (duty cycle) of the light bulb from the ambient light level
+uint8_t initial_ocr(void) {
 	read_adc();
 	// determine the initial compare value (duty cycle) depending on the value read from the ADC
 	// the greater the ADC value the lower the duty cycle (dimmer the bulb will be) and vice versa
 	if (brightness > 700) {
-		ocr = 68.0; 
-		uart_transmit_string("Surrounding is bright. Brightness level of light set to low");
-		uart_put_byte('\n');
+		uart_printf(PSTR("Surrounding is bright. Brightness level of light set to low\n"));
+		return 68;
 	}
 	else if (brightness < 250) {
-		ocr = 255.0;
-		uart_transmit_string("Surrounding is dark. Brightness level of light set to high");
-		uart_put_byte('\n');
+		uart_printf(PSTR("Surrounding is dark. Brightness level of light set to high\n"));
+		return 255;
 	}
 	else {
-		ocr = 190.0;
-		uart_transmit_string("Surrounding is neither bright nor dark. Brightness level of light set to medium");
-		uart_put_byte('\n');
+		uart_printf(PSTR("Surrounding is neither bright nor dark. Brightness level of light set to medium\n"));
+		return 190;
 	}
-	// calculate the time required between each decrement of the compare value for x amount of time.
-	// note that ordinarily this would be 1000 * time / ocr, however due to artificial delays this number has been adjusted
-	int delay = 950 * time / ocr;	
+}
+
+// turn on light bulb and dim it over time
+void dim_bulb(uint32_t time) {
+	fade_bulb(time, initial_ocr(), 1);
+}
+
+// dim the light bulb from 'ocr' to off over 'time' seconds, starting at step 'count' (1 unless resuming after a reset)
+// the fade goes down one bulb level at a time so there are BULB_LEVEL(ocr) steps
+void fade_bulb(uint32_t time, uint8_t ocr, uint16_t count) {
+	uint16_t steps = BULB_LEVEL(ocr);
+	// calculate the time required between each decrement of the level for x amount of time.
+	// note that ordinarily this would be 1000 * time / steps, however due to artificial delays this number has been adjusted
+	// (950 * MAX_TIME still fits in 32 bits)
+	uint32_t total = 950UL * time;
+	uint32_t delay = total / steps;
+	// the remainder is spread over the steps so the fade doesn't drift for long times
+	// (remainder and error are both under steps, so error + remainder fits in 16 bits)
+	uint16_t remainder = total % steps;
+	uint16_t error = 0;
 	_delay_ms(5);
+	write_bulb_level(steps - (count - 1));
+#if CLOSED_LOOP_MODE
+	start_control(steps - (count - 1));
+#endif
 	// decrement the compare value reducing the duty cycle and hence brightness, every 'delay' amount of time
 	do {
-		// within the delay function it checks whether the button is pressed which will end the process
-		if (my_delay(delay) == 1) {
-			clear();
+		save_fade(time, ocr, count);
+		uint32_t step = delay;
+		error += remainder;
+		if (error >= steps) {
+			error -= steps;
+			step++;
+		}
+		// within the delay function it checks for a button press or the end of the countdown which will end the process
+		uint8_t event = my_delay(step);
+		if (event != EVENT_NONE) {
+			end_process(event);
 			break;
 		}
-		OCR2A = ocr - count;
+		set_bulb(steps - count);
 		count++;
-		// check outside the delay function whether the button is pressed which will end the process
-		if (switch_state != prevState) {
-			prevState = switch_state;
-			if (switch_state == 1 ) {
-				clear();
-				break;
-			}
-		}
 	}
-	// until the compare value reaches 0 whereby the lightbulb will be off
-	while (OCR2A != 0);
+	// until the level reaches 0 whereby the lightbulb will be off
+	while (count <= steps);
+#if CLOSED_LOOP_MODE
+	stop_control();
+	write_bulb_level(0);
+#endif
 }
 
 // Turn the light bulb on but do not dim it overtime
 void bulb_on(void) {
-	double ocr;
 	lcd_write_string(0, 0, "No dimming");
-	read_adc();
-	// determine the compare value (duty cycle) depending on the value read from the ADC
-	// the greater the ADC value the lower the duty cycle (dimmer the bulb will be) and vice versa
-	if (brightness > 700) {
-		ocr = 68.0; 
-		uart_transmit_string("Surrounding is bright. Brightness level of light set to low");
-		uart_put_byte('\n');
+	hold_bulb(initial_ocr());
+}
+
+// set the compare value/duty cycle and keep it constant until a button press is detected which will stop this process
+void hold_bulb(uint8_t ocr) {
+	write_bulb_level(BULB_LEVEL(ocr));
+#if CLOSED_LOOP_MODE
+	start_control(BULB_LEVEL(ocr));
+#endif
+	save_fade(0, ocr, 1);
+	// stay on until the button is pressed (or a bus command changes the light)
+	while (my_delay(1) == EVENT_NONE);
+	clear();
+}
+
+// after a watchdog or brown-out reset, carry on with the fade that was running from where it was saved
+// returns 0 if there was nothing to resume
+uint8_t resume_fade(void) {
+	if (!(reset_cause & (1 << WDRF | 1 << BORF))) {
+		return 0;
 	}
-	else if (brightness < 250) {
-		ocr = 255.0;
-		uart_transmit_string("Surrounding is dark. Brightness level of light set to high");
-		uart_put_byte('\n');
+	uart_printf(PSTR("Recovered from a %S reset\n"), BIT_IS_SET(reset_cause, WDRF) ? PSTR("watchdog") : PSTR("brown-out"));
+	if (saved_fade.check != fade_checksum() || saved_fade.ocr == 0 || saved_fade.count > BULB_LEVEL(saved_fade.ocr)) {
+		return 0;
+	}
+	uart_printf(PSTR("Resuming the night light\n"));
+#if !BUS_MODE
+	// switch the uart receive off like menu() does
+	uart_receive_enable(0);
+#endif
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		time_int = saved_fade.time;
+		time_selected = (saved_fade.time != 0);
+	}
+#if CLOSED_LOOP_MODE
+	// start_control() takes the ambient light level from brightness
+	brightness = saved_fade.ambient;
+#endif
+	lcd_clear();
+	if (time_selected) {
+		// work out how much of the countdown had gone from how far through the fade it was
+		start_countdown((uint32_t)(saved_fade.count - 1) * saved_fade.time / BULB_LEVEL(saved_fade.ocr));
+		fade_bulb(saved_fade.time, saved_fade.ocr, saved_fade.count);
 	}
 	else {
-		ocr = 190.0;
-		uart_transmit_string("Surrounding is neither bright nor dark. Brightness level of light set to medium");
-		uart_put_byte('\n');
+		start_countdown(0);
+		lcd_write_string(0, 0, "No dimming");
+		hold_bulb(saved_fade.ocr);
+	}
+	return 1;
+}
+
+// remember how far through the fade the light bulb is so it can be resumed after a reset
+void save_fade(uint32_t time, uint8_t ocr, uint16_t count) {
+	saved_fade.time = time;
+	saved_fade.ocr = ocr;
+	saved_fade.count = count;
+#if CLOSED_LOOP_MODE
+	saved_fade.ambient = light_ambient;
+#endif
+	saved_fade.check = fade_checksum();
+}
+
+// checksum of the saved fade, so the random contents of SRAM after power on aren't taken as a saved fade
+uint8_t fade_checksum(void) {
+	uint8_t *bytes = (uint8_t *)&saved_fade;
+	uint8_t check = 0xA5;
+	for (uint8_t i = 0; i < sizeof(saved_fade) - 1; i++) {
+		check = (check << 1 | check >> 7) ^ bytes[i];
+	}
+	return check;
+}
+
+// set the brightness level of the light bulb
+// in closed loop mode this sets the light level for the controller to hold instead, scaled so that 0 is the
+// ambient light level and control_level is the level that was measured when the controller started
+void set_bulb(uint16_t level) {
+#if CLOSED_LOOP_MODE
+	if (control_enabled) {
+		uint16_t target = light_ambient + (uint32_t)(light_reference - light_ambient) * level / control_level;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			light_target = target;
+		}
+		return;
+	}
+#endif
+	write_bulb_level(level);
+}
+
+// set the brightness level the timer 2 overflow ISR outputs
+void write_bulb_level(uint16_t level) {
+	// 16-bit write that the ISR mustn't see half of
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		bulb_level = level;
+	}
+#if TRACE_ENABLED
+	if ((level >> PWM_DITHER_BITS) != trace_duty) {
+		trace_duty = level >> PWM_DITHER_BITS;
+		trace('L', PSTR("%u"), level);
+	}
+#endif
+}
+
+#if CLOSED_LOOP_MODE
+// measure the light level with the bulb at 'level' and start the controller holding it
+void start_control(uint16_t level) {
+	// brightness still holds the reading taken before the bulb was turned on (or the one saved with the fade when
+	// resuming, see resume_fade()), kept here so save_fade() can save it
+	light_ambient = brightness;
+	_delay_ms(CONTROL_SETTLE_MS);
+	uint16_t reference = read_adc();
+	// the sensor can't see the bulb, so there is nothing to control
+	if (reference <= light_ambient || level == 0) {
+		uart_printf(PSTR("Light sensor can't see the bulb: closed loop control off\n"));
+		return;
+	}
+	light_reference = reference;
+	control_level = level;
+	// start the integral at the current output so the bulb doesn't jump when the controller takes over
+	control_integral = (int32_t)level << (8 - PWM_DITHER_BITS);
+	control_output = level;
+	light_target = reference;
+	SET_BIT(ADCSRA, ADIE);
+	control_enabled = 1;
+}
+
+// stop the controller, leaving the compare value where it is
+void stop_control(void) {
+	control_enabled = 0;
+	CLEAR_BIT(ADCSRA, ADIE);
+}
+
+// one step of the PI controller, returns the bulb level to output when the sensor reads 'reading' and should read
+// 'target'. Only uses control_integral and control_output, which carry over to the next step
+uint16_t control_step(uint16_t target, uint16_t reading) {
+	int16_t error = (int16_t)target - (int16_t)reading;
+	// everything is in 1/256ths of a compare value step, the output keeps PWM_DITHER_BITS of its fraction as bulb levels
+	int32_t level = ((int32_t)error * CONTROL_KP + control_integral) >> (8 - PWM_DITHER_BITS);
+	// the bulb can't go past full or off, or change by more than the slew limit in one step
+	int32_t highest = (int32_t)control_output + (CONTROL_SLEW << PWM_DITHER_BITS);
+	int32_t lowest = (int32_t)control_output - (CONTROL_SLEW << PWM_DITHER_BITS);
+	if (highest > BULB_LEVEL_MAX) {
+		highest = BULB_LEVEL_MAX;
+	}
+	if (lowest < 0) {
+		lowest = 0;
+	}
+	// anti-windup: stop integrating while the output is held at a limit and the error would push it further
+	// (including the slew limit, otherwise the integral builds up during a big change and overshoots at the end)
+	uint8_t held = 0;
+	if (level >= highest) {
+		level = highest;
+		held = (error > 0);
+	}
+	else if (level <= lowest) {
+		level = lowest;
+		held = (error < 0);
+	}
+	if (!held) {
+		control_integral += (int32_t)error * CONTROL_KI;
+		if (control_integral > CONTROL_FULL) {
+			control_integral = CONTROL_FULL;
+		}
+		else if (control_integral < 0) {
+			control_integral = 0;
+		}
+	}
+	control_output = level;
+	return level;
+}
+#endif
+
+// called regularly by the main program, the watchdog is only reset once every task has checked in
+// so it will reset the program if the main loop or any of the ISRs stop running
+void watchdog_checkpoint(void) {
+	uint8_t required = TASK_MAIN | TASK_DEBOUNCE;
+	if (BIT_IS_SET(TIMSK1, OCIE1A)) {
+		required |= TASK_COUNTDOWN;
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		tasks_alive |= TASK_MAIN;
+		if ((tasks_alive & required) == required) {
+			wdt_reset();
+			tasks_alive = 0;
+		}
 	}
-	// set the compare value/duty cycle and keep it constant until a button press is detected which will stop this process
-	OCR2A = ocr;
-	while (switch_state != 1){};
-	clear();
 }
 
 
 //**** Interrupts ****//
 
 // Interrupt that triggers every second of the countdown 
+// only the timekeeping is done here, the LCD and serial output are left to countdown_update() in the main loop so
+// this never holds up the timer 0 and timer 2 interrupts
 ISR(TIMER1_COMPA_vect) {
+	tasks_alive |= TASK_COUNTDOWN;
+	// reset the counter 
+	TCNT1 = 0;
+	if (!tick_queued) {
+		tick_queued = event_post(EVENT_TICK);
+	}
 	if (time_selected) {
-		// calculate the time remaining and convert it into a string 
-		char time_remaining_string[10] = {'\0'};
-		int time_remaining = time_int - elapsed_time;
-		int_to_string(time_remaining, time_remaining_string);
+		uint32_t time_remaining = time_int - elapsed_time;
 		elapsed_time++;
-		// reset the counter 
-		TCNT1 = 0;
 		if (time_remaining == 0) {
 			// turn off timer 1 compare interrupt 
 			CLEAR_BIT(TIMSK1, OCIE1A);
-			uart_transmit_string("0");
-			lcd_write_string(6, 0, "0");
-			lcd_write_string(0, 1, "Goodnight!");
-			uart_put_byte('\n');
-			// stop sending 5v through the columns of the LED matrix (turning it off)
-			CLEAR_BITS(PORTC, (1 << 1 | 1 << 2 | 1 << 3 | 1 << 4 | 1 << 5));
-			_delay_ms(1000);
-			// clear global variables such as elapsed time & LCD
-			clear();
+			// let the main loop clear global variables such as elapsed time & LCD (after the last tick is shown)
+			event_post(EVENT_COUNTDOWN_DONE);
+		}
+	}
+}
+
+#if CLOSED_LOOP_MODE
+// Interrupt when a light sensor sample is ready, runs one step of the PI controller (see control_step())
+// the 32-bit maths is the slowest interrupt work, so it lets the other interrupts in. This can't nest with itself
+// (timer 0 starts a sample every CONTROL_DIVIDER overflows, long after this has finished) and bulb_level, the only
+// thing it shares with another ISR, is written atomically
+ISR(ADC_vect, ISR_NOBLOCK) {
+	uint16_t level = control_step(light_target, ADC);
+	// the timer 2 overflow ISR can interrupt this
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		bulb_level = level;
+	}
+}
+#endif
+
+// Interrupt at the start of every PWM cycle (7.8kHz), picks the compare value for the next cycle
+// first order sigma-delta: the fraction of the level below the compare value resolution is added up and an
+// extra step is output each time it carries, so the average brightness matches the level
+// estimated at about 75 cycles including the interrupt response, about 4% of the 2048 cycle PWM period (not measured,
+// PWM_ISR_PROFILE measures it on the board)
+ISR(TIMER2_OVF_vect) {
+	uint16_t level = bulb_level;
+	uint16_t duty = level >> PWM_DITHER_BITS;
+	dither_error += level & ((1 << PWM_DITHER_BITS) - 1);
+	if (dither_error >= (1 << PWM_DITHER_BITS)) {
+		dither_error -= (1 << PWM_DITHER_BITS);
+		duty++;
+	}
+	// a compare value of n is high for n + 1 out of 256 counts, so 0 needs the output disconnecting to be off
+	if (duty == 0) {
+		CLEAR_BIT(TCCR2A, COM2A1);
+	}
+	else {
+		OCR2A = duty - 1;
+		SET_BIT(TCCR2A, COM2A1);
+	}
+#if PWM_ISR_PROFILE
+	// timer 2 has counted (in steps of 8 cycles) since the overflow that started this interrupt
+	uint8_t ticks = TCNT2;
+	if (ticks > pwm_isr_ticks_max) {
+		pwm_isr_ticks_max = ticks;
+	}
+#endif
+}
+
+// Interrupt when the UART can take another byte, sends the transmit buffer until it is empty
+ISR(USART_UDRE_vect) {
+	UDR0 = uart_tx_buffer[uart_tx_tail];
+#if BUS_DRIVER_ENABLE
+	// clear the transmit complete flag so it only means the last byte has gone (FE0, DOR0 and UPE0 must be written 0)
+	UCSR0A = (UCSR0A & (1 << U2X0 | 1 << MPCM0)) | (1 << TXC0);
+#endif
+	uart_tx_tail = (uart_tx_tail + 1) & (UART_TX_BUFFER_SIZE - 1);
+	if (uart_tx_tail == uart_tx_head) {
+		CLEAR_BIT(UCSR0B, UDRIE0);
+#if BUS_DRIVER_ENABLE
+		SET_BIT(UCSR0B, TXCIE0);
+#endif
+	}
+}
+
+#if BUS_DRIVER_ENABLE
+// Interrupt once the last byte has been shifted out, lets go of the bus
+ISR(USART_TX_vect) {
+	if (uart_tx_tail == uart_tx_head) {
+		CLEAR_BIT(BUS_DE_PORT, BUS_DE_PIN);
+	}
+	CLEAR_BIT(UCSR0B, TXCIE0);
+}
+#endif
+
+#if BUS_MODE
+// Interrupt for each byte received in bus mode, collects lines and passes the ones for this unit to the main loop
+ISR(USART_RX_vect) {
+	char ch = UDR0;
+	if (ch != '\n' && ch != '\r') {
+		if (bus_frame_length < BUS_FRAME_LENGTH - 1) {
+			bus_frame[bus_frame_length++] = ch;
 		}
 		else {
-			// display the time remaining via serial output
-			uart_transmit_string(time_remaining_string);
-			uart_put_byte('\n');
-			// display the time remaining via the LCD 
-			lcd_clear();
-			lcd_write_string(0, 0, "Time:");
-			lcd_write_string(6, 0, time_remaining_string);
-			// display the current led brightness
-			lcd_write_brightness();
+			// too long, skip the rest of the line
+			bus_frame_length = BUS_FRAME_LENGTH;
 		}
+		return;
 	}
-	else {
-		// just display the current brightness 
-		lcd_write_brightness();
+	// lines that arrive while the last command is still being handled are dropped
+	if (bus_frame_length < BUS_FRAME_LENGTH && !bus_command_ready) {
+		bus_frame[bus_frame_length] = '\0';
+		uint8_t start = bus_parse_address(bus_frame);
+		if (start != 0) {
+			strcpy(bus_command_text, &bus_frame[start]);
+			bus_command_ready = 1;
+			event_post(EVENT_BUS_COMMAND);
+		}
 	}
+	bus_frame_length = 0;
 }
+#endif
 
 // Interrupt for debouncing and multiplexing the LED matrix 
 ISR(TIMER0_OVF_vect) {
+#if TIMER0_LATENCY_PROFILE
+	// timer 0 has counted (in steps of TIMER0_PRESCALER cycles) since the overflow that started this interrupt
+	uint8_t latency = TCNT0;
+	if (latency > timer0_latency_max) {
+		timer0_latency_max = latency;
+	}
+#endif
+	tasks_alive |= TASK_DEBOUNCE;
 	// debouncing the button 
 	uint8_t mask = 0b00111111;
-	uint8_t value = BIT_VALUE(PINB, 5);
+#if TRACE_REPLAY
+	uint8_t value = replay_button(trace_ticks + 1);
+#else
+	uint8_t value = BIT_VALUE(BUTTON_INPUT, BUTTON_PIN);
+#endif
+#if TRACE_ENABLED
+	trace_ticks++;
+	if (value != trace_button) {
+		trace_button = value;
+		uint8_t head = trace_button_head;
+		uint8_t next = (head + 1) & (TRACE_BUTTON_QUEUE_SIZE - 1);
+		if (next != trace_button_tail) {
+			trace_button_ticks[head] = trace_ticks;
+			trace_button_levels[head] = value;
+			trace_button_head = next;
+		}
+		else if (trace_dropped != 0xFF) {
+			trace_dropped++;
+		}
+	}
+#endif
 	bit_count = ((bit_count << 1) & mask) | value;
 	// requires 6 or more consecutive overflow readings of 1 from the button PIN to indicate button is pressed
 	if(bit_count == mask) {
+		// only post an event on the press itself (not while the button is held down)
+		if (switch_state == 0) {
+			event_post(EVENT_BUTTON_PRESSED);
+		}
 		switch_state = 1;
 	}
 	// requires 6 or more consecutive overflow readings of 0 from the button PIN to indicate that the button is not pressed
 	else if (bit_count == 0) {
 		switch_state = 0;
 	}
+
+#if CLOSED_LOOP_MODE
+	// start a light sensor sample at a fixed rate for the controller
+	if (control_enabled && ++control_divider == CONTROL_DIVIDER) {
+		control_divider = 0;
+		SET_BIT(ADCSRA, ADSC);
+	}
+#endif
 	
 	// reset all the columns and rows so no LEDs in the matrix are on 
-	CLEAR_BITS(PORTC, (1 << 1 | 1 << 2 | 1 << 3 | 1 << 4 | 1 << 5));
-	SET_BITS(PORTD, (1 << 2 | 1 << 3));
-	SET_BITS(PORTB, (1 << 2 | 1 << 4));
+	matrix_columns_off();
+	SET_BITS(PORTD, MATRIX_ROWS_PORTD_MASK);
+	SET_BITS(PORTB, MATRIX_ROWS_PORTB_MASK);
 	
-	// if the process function is running 
+	// if the matrix is enabled (while the process function is running)
 	// every overflow turn only one column on and its respective rows, turn other columns off 
 	// cycle through columns after each overflow 
-	if (status == 1) {
-		if (matrix_column_count == 1) {
-			// send voltage through the first column 
-			SET_BIT(PORTC, 1);
-			// ground the specific rows you want the LED to be on
-			CLEAR_BIT(PORTB, 4);
-			CLEAR_BIT(PORTD, 3);
-			// set the specific rows you do not want to be on 
-			SET_BIT(PORTD, 2);
-			SET_BIT(PORTB, 2);
-		}
-		else if (matrix_column_count == 2) {
-			SET_BIT(PORTC, 2);
-			CLEAR_BIT(PORTB, 2);
-			CLEAR_BIT(PORTD, 3);
-			SET_BIT(PORTD, 2);
-			SET_BIT(PORTB, 4);
-		}
-		else if (matrix_column_count == 3) {
-			SET_BIT(PORTC, 3);
-			CLEAR_BITS(PORTD, (1 << 2 | 1 << 3));
-			CLEAR_BIT(PORTB, 2);
-			SET_BIT(PORTB, 4);
-		}
-		else if (matrix_column_count == 4) {
-			SET_BIT(PORTC, 4);
-			CLEAR_BIT(PORTB, 2);
-			CLEAR_BIT(PORTD, 3);
-			SET_BIT(PORTD, 2);
-			SET_BIT(PORTB, 4);
+	// the animation is worked out by matrix_animate() in the main loop, so this costs the same for every frame
+	matrix_ticks++;
+	if (matrix_enabled) {
+		uint8_t column = matrix_column;
+		// only swap in a new frame between refreshes
+		if (column == 0 && matrix_swap_pending) {
+			matrix_front ^= 1;
+			matrix_swap_pending = 0;
 		}
-		else {
-			SET_BIT(PORTC, 5);
-			CLEAR_BIT(PORTB, 4);
-			CLEAR_BIT(PORTD, 3);
-			SET_BIT(PORTD, 2);
-			SET_BIT(PORTB, 2);
-			// once reaching the final column count reset column count
-			matrix_column_count = 0;
+		uint8_t front = matrix_front;
+		// ground the specific rows you want the LED to be on
+		CLEAR_BITS(PORTB, matrix_buffer_portb[front][column]);
+		// then send voltage through the column (PORTD can hold both rows and columns)
+		PORTD = (PORTD & ~matrix_buffer_portd[front][column]) | matrix_columns_portd[column];
+		SET_BITS(PORTC, matrix_columns_portc[column]);
+		// once reaching the final column reset the column
+		column++;
+		if (column == MATRIX_COLUMNS) {
+			column = 0;
 		}
-		matrix_column_count++;
+		matrix_column = column;
 	}
 
 }
@@ -539,90 +1546,478 @@ ISR(TIMER0_OVF_vect) {
 
 //**** FUNCTIONS ****//
 
-// print the current brightness level of the light bulb via LCD
+// pick the animation for the process that is starting and show its first frame
+// a button press can start the process again while the matrix is still being shown (after the fade, before the
+// countdown ends), so the ISR is stopped first and only starts drawing again once the new frame is in place
+void matrix_start(void) {
+	matrix_enabled = 0;
+	matrix_animation = time_selected ? &MATRIX_ANIMATION_DIMMING : &MATRIX_ANIMATION_ON;
+	matrix_frame = matrix_animation->follows_progress ? matrix_animation->count - 1 : 0;
+	matrix_load(matrix_frame);
+	// nothing is being shown so the new frame can go straight to the front
+	matrix_front ^= 1;
+	matrix_swap_pending = 0;
+	matrix_column = 0;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		matrix_frame_start = matrix_ticks;
+	}
+	matrix_enabled = 1;
+}
+
+// stop the ISR scanning the LED matrix and turn it off
+void matrix_stop(void) {
+	matrix_enabled = 0;
+	// PORTD also has the bus driver enable on it, which the transmit complete ISR can change in the middle of this
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		matrix_columns_off();
+	}
+}
+
+// move the LED matrix animation on to the next frame when it is due, call this often from the main loop
+void matrix_animate(void) {
+	// wait for the ISR to show the last frame before drawing the next one
+	if (status == 0 || matrix_swap_pending) {
+		return;
+	}
+	uint8_t frame = matrix_frame;
+	if (matrix_animation->follows_progress) {
+		uint32_t total;
+		uint32_t remaining = 0;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			total = time_int;
+			if (elapsed_time < total) {
+				remaining = total - elapsed_time;
+			}
+		}
+		// without a countdown the first frame stays up
+		if (total == 0) {
+			return;
+		}
+		// rounded up so frame 0 is only shown once the time is up
+		frame = (remaining * (matrix_animation->count - 1) + total - 1) / total;
+	}
+	else {
+		uint16_t duration = pgm_read_word(&matrix_animation->frames[frame].duration);
+		uint16_t ticks;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			ticks = matrix_ticks;
+		}
+		if (duration == 0 || (uint16_t)(ticks - matrix_frame_start) < duration) {
+			return;
+		}
+		matrix_frame_start = ticks;
+		frame++;
+		if (frame == matrix_animation->count) {
+			frame = 0;
+		}
+	}
+	if (frame != matrix_frame) {
+		matrix_frame = frame;
+		matrix_load(frame);
+	}
+}
+
+// draw a frame of the current animation into the back buffer for the ISR to swap in
+void matrix_load(uint8_t frame) {
+	uint8_t back = matrix_front ^ 1;
+	for (uint8_t column = 0; column < MATRIX_COLUMNS; column++) {
+		uint8_t rows = pgm_read_byte(&matrix_animation->frames[frame].rows[column]);
+		matrix_buffer_portb[back][column] = MATRIX_ROWS_PORTB(rows);
+		matrix_buffer_portd[back][column] = MATRIX_ROWS_PORTD(rows);
+	}
+	matrix_swap_pending = 1;
+}
+
+// stop sending 5v through all the columns of the LED matrix
+static inline void matrix_columns_off(void) {
+	CLEAR_BITS(PORTC, MATRIX_COLUMNS_PORTC_MASK);
+	if (MATRIX_COLUMNS_PORTD_MASK) {
+		CLEAR_BITS(PORTD, MATRIX_COLUMNS_PORTD_MASK);
+	}
+}
+
+// show the current brightness level (duty cycle) of the light bulb as a bar across the bottom line of the LCD
 void lcd_write_brightness(void){
-	if (OCR2A > 190) {
-			lcd_write_string(0, 1, "Light: Bright");
+	uint16_t level;
+	// in closed loop mode the ADC ISR changes the level, so it can't be read a byte at a time
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		level = bulb_level;
+	}
+	lcd_write_bar(0, 1, BRIGHTNESS_BAR_CELLS, level, BULB_LEVEL_MAX, brightness_bar);
+}
+
+// show the fraction of the selected time that is remaining as a bar next to the countdown
+void lcd_write_progress(uint32_t time_remaining) {
+	lcd_write_bar(PROGRESS_BAR_X, 0, PROGRESS_BAR_CELLS, time_remaining, time_int, progress_bar);
+}
+
+// draw value/max as a bar graph 'cells' characters wide starting at x, y with a resolution of 5 steps per character
+// shown holds what each cell currently displays, only the cells that changed are sent to the LCD
+void lcd_write_bar(uint8_t x, uint8_t y, uint8_t cells, uint32_t value, uint32_t max, uint8_t shown[]) {
+	// value * steps fits in 32 bits for anything up to MAX_TIME
+	uint8_t steps = value * (cells * BAR_STEPS_PER_CELL) / max;
+	// the cell the LCD cursor is at, the cursor only needs moving when a cell is skipped
+	uint8_t cursor = 0xFF;
+	for (uint8_t i = 0; i < cells; i++) {
+		uint8_t glyph = ' ';
+		if (steps >= BAR_STEPS_PER_CELL) {
+			glyph = BAR_STEPS_PER_CELL;
+			steps -= BAR_STEPS_PER_CELL;
 		}
-		else if (OCR2A < 68) {
-			lcd_write_string(0, 1, "Light: Dim");
+		else if (steps > 0) {
+			glyph = steps;
+			steps = 0;
 		}
-		else {
-			lcd_write_string(0, 1, "Light: Medium");
+		if (shown[i] != glyph) {
+			if (cursor != i) {
+				lcd_setCursor(x + i, y);
+			}
+			lcd_write(glyph);
+			shown[i] = glyph;
+			cursor = i + 1;
 		}
+	}
 }
 
 // take a variable int and produce a delay of that time e.g. if the provided argument was 10
 // this function would produce 10 1ms delays
-// function returns 1 if the button is clicked during the delay process and 0 if there were no clicks
-uint8_t my_delay(int delay) {
+// function returns the event that ended the delay early (e.g. a button click) or EVENT_NONE if there were none
+uint8_t my_delay(uint32_t delay) {
 	 while(delay--) {
 		_delay_ms(1);
-		if (switch_state != prevState) {
-			prevState = switch_state;
-			if (switch_state == 1 ) {
-			
-				return 1;
-			}
+		watchdog_checkpoint();
+#if TRACE_ENABLED
+		trace_poll();
+#endif
+		matrix_animate();
+		uint8_t event = event_next();
+		if (event != EVENT_NONE) {
+			return event;
 		}
 	 }
-	 return 0;
+	 return EVENT_NONE;
+}
+
+// add an event to the queue, only call this from an ISR
+// if the queue is full the event is dropped, returns 1 if it was added
+static inline uint8_t event_post(uint8_t event) {
+	uint8_t next = (event_head + 1) & (EVENT_QUEUE_SIZE - 1);
+	if (next == event_tail) {
+		return 0;
+	}
+	event_queue[event_head] = event;
+	event_head = next;
+	return 1;
+}
+
+// take the oldest event off the queue, returns EVENT_NONE if the queue is empty
+uint8_t event_get(void) {
+	uint8_t event = EVENT_NONE;
+	if (event_tail != event_head) {
+		event = event_queue[event_tail];
+		event_tail = (event_tail + 1) & (EVENT_QUEUE_SIZE - 1);
+#if TRACE_ENABLED
+		trace('E', PSTR("%u"), event);
+#endif
+	}
+	return event;
+}
+
+// discard all events that are waiting in the queue
+void event_flush(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		event_tail = event_head;
+		tick_queued = 0;
+	}
+}
+
+// take the next event off the queue and do the deferred work for the ones that only need that (countdown ticks and
+// bus polls), returns the events the caller has to act on
+uint8_t event_next(void) {
+	uint8_t event = event_get();
+	if (event == EVENT_TICK) {
+		tick_queued = 0;
+		countdown_update();
+		event = EVENT_NONE;
+	}
+#if BUS_MODE
+	else if (event == EVENT_BUS_COMMAND) {
+		event = bus_command();
+	}
+#endif
+	return event;
+}
+
+// bottom half of the countdown interrupt, brings the LCD and serial output up to date with elapsed_time
+// catches up in one go if the main loop was held up for more than a second
+void countdown_update(void) {
+	// a tick can still be queued after the process has been cleared
+	if (status == 0) {
+		return;
+	}
+	uint32_t elapsed;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		elapsed = elapsed_time;
+	}
+	// nothing new (an earlier tick already caught up)
+	if (elapsed == countdown_drawn) {
+		return;
+	}
+	countdown_drawn = elapsed;
+	if (!time_selected) {
+		// just display the current brightness 
+		lcd_write_brightness();
+		return;
+	}
+	// the first tick shows the starting time, each one after that counts the hh:mm:ss string down by a second
+	uint8_t changed = countdown_changed;
+	while (countdown_shown + 1 < elapsed) {
+		uint8_t digit = countdown_decrement(countdown_string);
+		if (digit < changed) {
+			changed = digit;
+		}
+		countdown_shown++;
+	}
+	countdown_changed = sizeof(countdown_string) - 1;
+	uint32_t time_remaining = time_int - countdown_shown;
+	// display the time remaining via serial output, skipped if the host hasn't taken the last few yet
+	uart_status(PSTR("%s\n"), countdown_string);
+	// display the time remaining via the LCD, only rewriting the digits that changed
+	if (changed < sizeof(countdown_string) - 1) {
+		lcd_write_string(changed, 0, &countdown_string[changed]);
+	}
+	lcd_write_progress(time_remaining);
+	if (time_remaining == 0) {
+		lcd_write_string(0, 1, "Goodnight!      ");
+		// turn the LED matrix off for the goodnight message
+		matrix_stop();
+	}
+	else {
+		// display the current led brightness
+		lcd_write_brightness();
+	}
+}
+
+// stop the process because of an event (button press, end of the countdown or a bus command)
+void end_process(uint8_t event) {
+	if (event == EVENT_COUNTDOWN_DONE) {
+		// leave the goodnight message up for a second
+		_delay_ms(1000);
+	}
+	clear();
 }
 
 // read ADC once button is pressed 
 uint16_t read_adc() {
+#if TRACE_REPLAY
+	brightness = replay_adc();
+#else
 	// start ADC conversion
 	SET_BIT(ADCSRA, ADSC);
 	// wait for buffer to empty/conversion to complete
 	while (ADCSRA & (1 << ADSC));
 	brightness = ADC;
-	int_to_string(brightness, brightness_string);
-	//uart_transmit_string(brightness_string);
-	return (ADC);
+#endif
+#if TRACE_ENABLED
+	trace('A', PSTR("%u"), brightness);
+#endif
+	//uart_printf(PSTR("%u\n"), brightness);
+	return brightness;
 }
 
 // once process is finished --> reset everything 
 void clear(void) {
-	OCR2A = 0;
-	uart_transmit_string("Goodnight!");
-	uart_put_byte('\n');
-	CLEAR_BIT(TIMSK1, OCIE1A);
+#if CLOSED_LOOP_MODE
+	stop_control();
+#endif
+	write_bulb_level(0);
+	uart_printf(PSTR("Goodnight!\n"));
+#if PWM_ISR_PROFILE
+	uart_printf(PSTR("Longest dithering interrupt (x8 cycles): %u\n"), pwm_isr_ticks_max);
+#endif
+#if TIMER0_LATENCY_PROFILE
+	uart_printf(PSTR("Longest timer 0 interrupt latency (x%u cycles): %u\n"), TIMER0_PRESCALER, timer0_latency_max);
+	timer0_latency_max = 0;
+#endif
 	lcd_clear();
-	elapsed_time = 0;
-	time_selected = 0;
-	time_int = 0;
+	// stop the countdown ISR and reset the variables it shares with the main loop
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		CLEAR_BIT(TIMSK1, OCIE1A);
+		elapsed_time = 0;
+		time_selected = 0;
+		time_int = 0;
+	}
 	brightness = 0;
-	memset(time_string, 0, 6);
+	memset(time_string, 0, TIME_STRING_LENGTH);
 	status = 0;
-	CLEAR_BITS(PORTC, (1 << 1 | 1 << 2 | 1 << 3 | 1 << 4 | 1 << 5));
-	// re-enable the uart receive
-	SET_BIT(UCSR0B, RXEN0);
-	// after clearing return back to the menu (serial I/O)
-	menu();
+	// nothing to resume after a reset now
+	saved_fade.ocr = 0;
+	matrix_stop();
+	// re-enable the uart receive, the main loop goes back to the menu (serial I/O)
+	uart_receive_enable(1);
 }
 
 // UART functions adapted from WK8 AMS send and receive exercise
 
-// send a string through serial output
-void uart_transmit_string(char str[]) {
-	int i = 0;
-	while (str[i] != '\0') {
-		uart_put_byte((unsigned char)(str[i]));
-		i++;
+// send a formatted message through serial output, waiting for room in the transmit buffer if it is full
+// the format string is in program memory (use PSTR()) and can contain %u and %d (16 bit, or 32 bit as %lu and %ld),
+// %c, %s (a string in RAM), %S (a string in program memory) and %%
+// don't call this from an ISR, the buffer can't empty while interrupts are off
+// in bus mode nothing is sent, units only talk on the bus when a command asks them to (see bus_reply())
+void uart_printf(const char *format, ...) {
+#if !BUS_MODE
+	va_list args;
+	va_start(args, format);
+	uart_vprintf(format, args);
+	va_end(args);
+#endif
+}
+
+// uart_printf() with the arguments already in a va_list
+void uart_vprintf(const char *format, va_list args) {
+	char line[UART_LINE_LENGTH];
+	uint8_t length = uart_format(line, UART_LINE_LENGTH, format, args);
+	uart_send_line_wait(line, length);
+}
+
+// send a status line (like the countdown) that is only worth sending while the host is keeping up
+// the line is dropped if the transmit buffer doesn't have room for all of it, so a slow host can't hold up the caller
+// and just sees fewer, up to date, lines. Returns 0 if the line was dropped (always, in bus mode)
+uint8_t uart_status(const char *format, ...) {
+#if BUS_MODE
+	return 0;
+#else
+	char line[UART_LINE_LENGTH];
+	va_list args;
+	va_start(args, format);
+	uint8_t length = uart_format(line, UART_LINE_LENGTH, format, args);
+	va_end(args);
+	return uart_send_line(line, length);
+#endif
+}
+
+// format a message into line (see uart_printf()), cutting it short if it is longer than size
+// returns the length, the line isn't null terminated
+uint8_t uart_format(char line[], uint8_t size, const char *format, va_list args) {
+	uint8_t length = 0;
+	char c;
+	while ((c = pgm_read_byte(format++)) != '\0' && length < size) {
+		if (c != '%') {
+			line[length++] = c;
+			continue;
+		}
+		c = pgm_read_byte(format++);
+		uint8_t is_long = 0;
+		if (c == 'l') {
+			is_long = 1;
+			c = pgm_read_byte(format++);
+		}
+		// text to copy into the line for this conversion
+		const char *text = NULL;
+		uint8_t text_in_progmem = 0;
+		// big enough for 4294967295
+		char number[11];
+		switch (c) {
+			case 'd':
+			case 'u': {
+				uint32_t value;
+				if (c == 'd') {
+					int32_t signed_value = is_long ? va_arg(args, int32_t) : va_arg(args, int);
+					value = signed_value;
+					if (signed_value < 0) {
+						line[length++] = '-';
+						value = -value;
+					}
+				}
+				else {
+					value = is_long ? va_arg(args, uint32_t) : va_arg(args, unsigned int);
+				}
+				// write the digits backwards from the end of number
+				uint8_t i = sizeof(number) - 1;
+				number[i] = '\0';
+				do {
+					number[--i] = (value % 10) + '0';
+					value /= 10;
+				} while (value != 0);
+				text = &number[i];
+				break;
+			}
+			case 'c':
+				line[length++] = va_arg(args, int);
+				break;
+			case 'S':
+				text_in_progmem = 1;
+				// fall through
+			case 's':
+				text = va_arg(args, const char *);
+				break;
+			case '\0':
+				// a % at the end of the format string
+				format--;
+				break;
+			default:
+				// %% and anything not understood are sent as is
+				line[length++] = c;
+				break;
+		}
+		if (text != NULL) {
+			while (length < size && (c = text_in_progmem ? pgm_read_byte(text) : *text) != '\0') {
+				line[length++] = c;
+				text++;
+			}
+		}
 	}
-	uart_put_byte('\0');
+	return length;
 }
 
-// send one byte through serial output
-void uart_put_byte(unsigned char data) {
-	// wait for empty transmit buffer
-	while (!BIT_IS_SET(UCSR0A, UDRE0));
-	// place data in data register 
-	UDR0 = data;
+// queue a whole line in the transmit buffer, returns 0 (and queues nothing) if there isn't room for all of it
+// only call this from the main loop: the line is copied in with interrupts on (the ISR only reads up to the head, which
+// is moved once the whole line is in), and they are only off for the few cycles it takes to start the ISR. Copying a
+// whole line with them off could hold up timer 0 by an estimated 2400 cycles (150us) for a 96 byte line (not
+// measured, TIMER0_LATENCY_PROFILE measures it on the board)
+uint8_t uart_send_line(const char line[], uint8_t length) {
+	uint8_t head = uart_tx_head;
+	uint8_t space = (uart_tx_tail - head - 1) & (UART_TX_BUFFER_SIZE - 1);
+	if (length > space) {
+		return 0;
+	}
+	for (uint8_t i = 0; i < length; i++) {
+		uart_tx_buffer[head] = line[i];
+		head = (head + 1) & (UART_TX_BUFFER_SIZE - 1);
+	}
+	uart_tx_head = head;
+	// UCSR0B is shared with the ISRs, and if the ISR was already running it may have sent the whole line by now, in
+	// which case it must not be started again on an empty buffer
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (uart_tx_tail != uart_tx_head) {
+#if BUS_DRIVER_ENABLE
+			// take the bus, the transmit complete ISR lets it go again
+			SET_BIT(BUS_DE_PORT, BUS_DE_PIN);
+#endif
+			// start sending if the ISR had stopped
+			SET_BIT(UCSR0B, UDRIE0);
+		}
+	}
+	return 1;
+}
+
+// queue a whole line in the transmit buffer, waiting for the data register empty ISR to make room for it
+void uart_send_line_wait(const char line[], uint8_t length) {
+	while (!uart_send_line(line, length)) {
+		// a byte takes over 100us to send, so checking every 10us doesn't slow the output down
+		_delay_us(10);
+	}
 }
 
 // receives one byte through serial input
 int uart_get_byte(unsigned char *data) {
+#if TRACE_REPLAY
+    uint32_t ticks;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ticks = trace_ticks;
+    }
+    return replay_byte(ticks, data);
+#else
     // If receive buffer contains data...
     if (BIT_IS_SET(UCSR0A, RXC0)) {
         // Copy received byte from UDR0 into memory location (*buffer)
@@ -632,8 +2027,194 @@ int uart_get_byte(unsigned char *data) {
     else {
         return 0;
     }
+#endif
+}
+
+#if TRACE_ENABLED
+// send a trace record "~<tick> <kind> <data>" (see TRACE_ENABLED), the data is formatted like uart_printf()
+// only called from the main loop, so it waits for room in the transmit buffer rather than losing the record
+void trace(char kind, const char *format, ...) {
+	// the button changes queued before this go out first so the records stay in tick order
+	trace_poll();
+	char line[UART_LINE_LENGTH];
+	uint32_t ticks;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		ticks = trace_ticks;
+	}
+	uint8_t length = trace_format(line, UART_LINE_LENGTH - 1, PSTR("~%lu %c "), ticks, kind);
+	va_list args;
+	va_start(args, format);
+	length += uart_format(&line[length], UART_LINE_LENGTH - 1 - length, format, args);
+	va_end(args);
+	line[length++] = '\n';
+	uart_send_line_wait(line, length);
 }
 
+// send the B records queued by the timer 0 ISR, and an X record if it had to drop any
+// call this often from the main loop, the queue only holds TRACE_BUTTON_QUEUE_SIZE - 1 changes
+void trace_poll(void) {
+	char line[24];
+	while (trace_button_tail != trace_button_head) {
+		uint8_t tail = trace_button_tail;
+		uint8_t length = trace_format(line, sizeof(line), PSTR("~%lu B %u\n"), trace_button_ticks[tail],
+			trace_button_levels[tail]);
+		uart_send_line_wait(line, length);
+		trace_button_tail = (tail + 1) & (TRACE_BUTTON_QUEUE_SIZE - 1);
+	}
+	uint8_t dropped;
+	uint32_t ticks;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		dropped = trace_dropped;
+		trace_dropped = 0;
+		ticks = trace_ticks;
+	}
+	if (dropped != 0) {
+		uint8_t length = trace_format(line, sizeof(line), PSTR("~%lu X %u\n"), ticks, dropped);
+		uart_send_line_wait(line, length);
+	}
+}
+
+// uart_format() with the arguments given directly
+uint8_t trace_format(char line[], uint8_t size, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	uint8_t length = uart_format(line, size, format, args);
+	va_end(args);
+	return length;
+}
+#endif
+
+#if BUS_MODE
+// check the address at the start of a received line ("@<id> " or "@* " for every unit)
+// returns where the command starts, or 0 if the line isn't for this unit. Only called from the receive ISR
+uint8_t bus_parse_address(const char frame[]) {
+	if (frame[0] != '@') {
+		return 0;
+	}
+	uint8_t i = 1;
+	if (frame[i] == '*') {
+		bus_addressed = 0;
+		i++;
+	}
+	else {
+		uint16_t id = 0;
+		while (frame[i] >= '0' && frame[i] <= '9' && id <= BUS_MAX_ID) {
+			id = id * 10 + (frame[i] - '0');
+			i++;
+		}
+		if (id != bus_id) {
+			return 0;
+		}
+		bus_addressed = 1;
+	}
+	if (frame[i] != ' ') {
+		return 0;
+	}
+	return i + 1;
+}
+
+// act on a command received from the bus, "poll" and "id <new id>" are answered straight away
+// returns EVENT_BUS_COMMAND for "dim <time>", "on" and "off" so the caller stops what the light is doing, bus_start()
+// then carries them out once the light has been cleared
+uint8_t bus_command(void) {
+	// split the command into its name and argument
+	bus_argument = strchr(bus_command_text, ' ');
+	if (bus_argument != NULL) {
+		*bus_argument++ = '\0';
+	}
+	if (strcmp_P(bus_command_text, PSTR("dim")) == 0 || strcmp_P(bus_command_text, PSTR("on")) == 0 ||
+		strcmp_P(bus_command_text, PSTR("off")) == 0) {
+		return EVENT_BUS_COMMAND;
+	}
+	if (strcmp_P(bus_command_text, PSTR("poll")) == 0) {
+		uint32_t remaining = 0;
+		uint16_t level;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			if (elapsed_time < time_int) {
+				remaining = time_int - elapsed_time;
+			}
+			level = bulb_level;
+		}
+		// state, seconds left and brightness level (0 to BULB_LEVEL_MAX)
+		bus_reply(PSTR("%S %lu %u\n"), status == 0 ? PSTR("idle") : time_selected ? PSTR("dimming") : PSTR("on"),
+			remaining, level);
+	}
+	else if (strcmp_P(bus_command_text, PSTR("id")) == 0 && bus_addressed) {
+		uint16_t id = 0;
+		for (char *c = bus_argument; c != NULL && *c != '\0' && id <= BUS_MAX_ID; c++) {
+			id = (*c >= '0' && *c <= '9') ? id * 10 + (*c - '0') : BUS_MAX_ID + 1;
+		}
+		if (id == 0 || id > BUS_MAX_ID) {
+			bus_reply(PSTR("bad id\n"));
+		}
+		else {
+			// the reply still comes from the old ID, which is what the host addressed
+			bus_reply(PSTR("ok\n"));
+			eeprom_update_byte(&bus_id_eeprom, id);
+			bus_id = id;
+		}
+	}
+	else {
+		bus_reply(PSTR("unknown command\n"));
+	}
+	// the receive ISR can take the next command now
+	bus_command_ready = 0;
+	return EVENT_NONE;
+}
+
+// carry out a "dim <time>", "on" or "off" command from the bus, called once the light has been cleared
+void bus_start(void) {
+	uint8_t start = 0;
+	if (strcmp_P(bus_command_text, PSTR("off")) == 0) {
+		// nothing more to do
+		bus_reply(PSTR("ok\n"));
+	}
+	else if (strcmp_P(bus_command_text, PSTR("on")) == 0) {
+		// clear() has set the time to 0, which means no dimming
+		start = 1;
+	}
+	else if (bus_argument != NULL && string_to_time(bus_argument)) {
+		time_selected = 1;
+		start = 1;
+	}
+	else {
+		bus_reply(PSTR("bad time\n"));
+	}
+	if (start) {
+		bus_reply(PSTR("ok\n"));
+	}
+	bus_command_ready = 0;
+	if (start) {
+		lcd_clear();
+		process();
+	}
+}
+
+// reply to a command on the bus with "#<id> " followed by the formatted message (see uart_printf())
+// only commands addressed to this unit get a reply, a broadcast would have every unit talking at once
+void bus_reply(const char *format, ...) {
+	if (!bus_addressed) {
+		return;
+	}
+	char line[UART_LINE_LENGTH];
+	uint8_t length = 0;
+	line[length++] = '#';
+	if (bus_id >= 100) {
+		line[length++] = (bus_id / 100) + '0';
+	}
+	if (bus_id >= 10) {
+		line[length++] = (bus_id / 10 % 10) + '0';
+	}
+	line[length++] = (bus_id % 10) + '0';
+	line[length++] = ' ';
+	va_list args;
+	va_start(args, format);
+	length += uart_format(&line[length], UART_LINE_LENGTH - length, format, args);
+	va_end(args);
+	uart_send_line_wait(line, length);
+}
+#endif
+
 // receive a string through serial input
 void uart_receive_string(char buffer[], int buff_len) {
 	int i = 0; // number of characters that have been added to the char array
@@ -645,9 +2226,23 @@ void uart_receive_string(char buffer[], int buff_len) {
 	while(1) {
 		// if it returns , then there is no byte available
 		// though you are also storing shit in ch
+		uint32_t idle = 0;
 		while(!uart_get_byte(&ch)) {
-			// do nothing
+			// waiting for the user is fine, but once they have started typing don't wait forever for the closing quote
+			watchdog_checkpoint();
+#if TRACE_ENABLED
+			trace_poll();
+#endif
+			_delay_us(100);
+			if (i > 0 && ++idle == RECEIVE_TIMEOUT_MS * 10) {
+				uart_printf(PSTR("Timed out waiting for the closing quote\n"));
+				memset(buffer, 0, buff_len);
+				i = 0;
+			}
 		}
+#if TRACE_ENABLED
+		trace('R', PSTR("%u"), ch);
+#endif
 		if (ch == '"' && i == 0) {
 			// clear the buffer 
 			memset(buffer, 0, buff_len);
@@ -665,38 +2260,98 @@ void uart_receive_string(char buffer[], int buff_len) {
 	buffer[i] = '\0';
 }
 
-// convert char to int
-int string_to_int(char buffer[]) { 
-	sscanf(buffer, "%d", &time_int);
-	if (time_int == 0) {
+// convert a time string to seconds and store it in time_int
+// accepts seconds ("90"), hh:mm:ss or mm:ss ("1:30:00") or unit suffixes ("1h30m", "45s")
+// returns 0 if the string is not a valid time, is 0 or is longer than MAX_TIME
+uint8_t string_to_time(char buffer[]) { 
+	uint32_t total = 0;
+	uint32_t value = 0;
+	// number of ':' so far, the minutes and seconds after one have to be under 60
+	uint8_t colons = 0;
+	for (int i = 0; buffer[i] != '\0'; i++) {
+		char ch = buffer[i];
+		if (ch >= '0' && ch <= '9') {
+			value = value * 10 + (ch - '0');
+		}
+		else if (ch == ':') {
+			if (++colons > 2 || (colons == 2 && value >= 60)) {
+				return 0;
+			}
+			total = (total + value) * 60;
+			value = 0;
+		}
+		else if (ch == 'h' || ch == 'H') {
+			total += value * 3600;
+			value = 0;
+		}
+		else if (ch == 'm' || ch == 'M') {
+			total += value * 60;
+			value = 0;
+		}
+		else if (ch == 's' || ch == 'S') {
+			total += value;
+			value = 0;
+		}
+		else if (ch != ' ') {
+			return 0;
+		}
+		// checking as we go stops the multiplications above from overflowing
+		if (value > MAX_TIME || total > MAX_TIME) {
+			return 0;
+		}
+	}
+	if (colons != 0 && value >= 60) {
 		return 0;
 	}
-	else {
-		return 1;
+	total += value;
+	if (total == 0 || total > MAX_TIME) {
+		return 0;
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		time_int = total;
 	}
+	return 1;
 }
 
-// integer to string conversion functions below adapted from WK10 example 1 file
-// Reverses a string 'str' of length 'len' 
-void reverse(char * str, int len) {
-  int i = 0, j = len - 1, temp;
-  while (i < j) {
-    temp = str[i];
-    str[i] = str[j];
-    str[j] = temp;
-    i++;
-    j--;
-  }
+// convert a number of seconds to a "hh:mm:ss" string (str needs space for 9 characters)
+void time_to_string(uint32_t seconds, char str[]) {
+	uint8_t hours = seconds / 3600;
+	uint16_t rest = seconds % 3600;
+	uint8_t minutes = rest / 60;
+	uint8_t secs = rest % 60;
+	str[0] = hours / 10 + '0';
+	str[1] = hours % 10 + '0';
+	str[2] = ':';
+	str[3] = minutes / 10 + '0';
+	str[4] = minutes % 10 + '0';
+	str[5] = ':';
+	str[6] = secs / 10 + '0';
+	str[7] = secs % 10 + '0';
+	str[8] = '\0';
 }
 
-// convert an integer to string 
-void int_to_string(int x, char str[]) {
-	int num_digits = log10(x) + 1;
-	for (int i = 0; i < num_digits; i++, x /= 10) {
-		str[i] = (x % 10) + '0';
+// count a "hh:mm:ss" string down by one second in place (like an odometer) rather than converting from seconds again
+// returns the position of the leftmost character that changed so only those need to be redrawn
+uint8_t countdown_decrement(char str[]) {
+	uint8_t i = 7;
+	while (i > 0) {
+		if (str[i] == ':') {
+			i--;
+		}
+		else if (str[i] != '0') {
+			str[i]--;
+			return i;
+		}
+		else {
+			// borrow from the digit to the left, the tens of minutes and seconds wrap to 5 and the rest to 9
+			str[i] = (i == 3 || i == 6) ? '5' : '9';
+			i--;
+		}
+	}
+	if (str[0] != '0') {
+		str[0]--;
 	}
-	reverse(str, num_digits);
-	str[num_digits] = '\0';
+	return 0;
 }
 
 /* ********************************************/
@@ -712,6 +2367,9 @@ void lcd_init(void){
   
   _lcd_displayfunction |= LCD_2LINE;
 
+  #if LCD_USING_I2C
+    lcd_i2c_init();
+  #else
   // RS Pin
   LCD_RS_DDR |= (1 << LCD_RS_PIN);
   // Enable Pin
@@ -735,15 +2393,23 @@ void lcd_init(void){
     LCD_DATA6_DDR |= (1 << LCD_DATA6_PIN);
     LCD_DATA7_DDR |= (1 << LCD_DATA7_PIN);
   #endif 
+  #endif
 
   // SEE PAGE 45/46 OF Hitachi HD44780 DATASHEET FOR INITIALIZATION SPECIFICATION!
 
   // according to datasheet, we need at least 40ms after power rises above 2.7V
   // before sending commands. Arduino can turn on way before 4.5V so we'll wait 50
-  _delay_us(50000); 
+  // timer 1 has been counting since reset so the rest of setup() overlaps this wait
+  while (TCNT1 < LCD_POWER_UP_TICKS) {
+  }
   // Now we pull both RS and Enable low to begin commands (R/W is wired to ground)
+  #if LCD_USING_I2C
+    _lcd_i2c_rs = 0;
+    lcd_i2c_queue(LCD_I2C_BACKLIGHT);
+  #else
   LCD_RS_PORT &= ~(1 << LCD_RS_PIN);
   LCD_ENABLE_PORT &= ~(1 << LCD_ENABLE_PIN);
+  #endif
   
   //put the LCD into 4 bit or 8 bit mode
   if (LCD_USING_4PIN_MODE) {
@@ -752,14 +2418,17 @@ void lcd_init(void){
 
     // we start in 8bit mode, try to set 4 bit mode
     lcd_write4bits(0b0111);
+    lcd_flush();
     _delay_us(4500); // wait min 4.1ms
 
     // second try
     lcd_write4bits(0b0111);
+    lcd_flush();
     _delay_us(4500); // wait min 4.1ms
     
     // third go!
     lcd_write4bits(0b0111); 
+    lcd_flush();
     _delay_us(150);
 
     // finally, set to 4-bit interface
@@ -799,26 +2468,38 @@ void lcd_init(void){
 
 /********** high level commands, for the user! */
 void lcd_write_string(uint8_t x, uint8_t y, char string[]){
+  #if TRACE_ENABLED
+    trace('S', PSTR("%u %u %s"), x, y, string);
+  #endif
   lcd_setCursor(x,y);
   for(int i=0; string[i]!='\0'; ++i){
     lcd_write(string[i]);
   }
 }
 
+#if LCD_USING_EXTRA_WRITES
 void lcd_write_char(uint8_t x, uint8_t y, char val){
   lcd_setCursor(x,y);
   lcd_write(val);
 }
+#endif
 
 void lcd_clear(void){
+  #if TRACE_ENABLED
+    trace('C', PSTR(""));
+  #endif
   lcd_command(LCD_CLEARDISPLAY);  // clear display, set cursor position to zero
+  lcd_flush();
   _delay_us(2000);  // this command takes a long time!
 }
 
+#if LCD_USING_EXTRA_WRITES
 void lcd_home(void){
   lcd_command(LCD_RETURNHOME);  // set cursor position to zero
+  lcd_flush();
   _delay_us(2000);  // this command takes a long time!
 }
+#endif
 
 
 // Allows us to fill the first 8 CGRAM locations
@@ -841,14 +2522,15 @@ void lcd_setCursor(uint8_t col, uint8_t row){
 }
 
 // Turn the display on/off (quickly)
-void lcd_noDisplay(void) {
-  _lcd_displaycontrol &= ~LCD_DISPLAYON;
-  lcd_command(LCD_DISPLAYCONTROL | _lcd_displaycontrol);
-}
 void lcd_display(void) {
   _lcd_displaycontrol |= LCD_DISPLAYON;
   lcd_command(LCD_DISPLAYCONTROL | _lcd_displaycontrol);
 }
+#if LCD_USING_DISPLAY_CONTROL
+void lcd_noDisplay(void) {
+  _lcd_displaycontrol &= ~LCD_DISPLAYON;
+  lcd_command(LCD_DISPLAYCONTROL | _lcd_displaycontrol);
+}
 
 // Turns the underline cursor on/off
 void lcd_noCursor(void) {
@@ -869,7 +2551,9 @@ void lcd_blink(void) {
   _lcd_displaycontrol |= LCD_BLINKON;
   lcd_command(LCD_DISPLAYCONTROL | _lcd_displaycontrol);
 }
+#endif
 
+#if LCD_USING_SCROLLING
 // These commands scroll the display without changing the RAM
 void scrollDisplayLeft(void) {
   lcd_command(LCD_CURSORSHIFT | LCD_DISPLAYMOVE | LCD_MOVELEFT);
@@ -877,7 +2561,9 @@ void scrollDisplayLeft(void) {
 void scrollDisplayRight(void) {
   lcd_command(LCD_CURSORSHIFT | LCD_DISPLAYMOVE | LCD_MOVERIGHT);
 }
+#endif
 
+#if LCD_USING_TEXT_DIRECTION
 // This is for text that flows Left to Right
 void lcd_leftToRight(void) {
   _lcd_displaymode |= LCD_ENTRYLEFT;
@@ -901,6 +2587,7 @@ void lcd_noAutoscroll(void) {
   _lcd_displaymode &= ~LCD_ENTRYSHIFTINCREMENT;
   lcd_command(LCD_ENTRYMODESET | _lcd_displaymode);
 }
+#endif
 
 /*********** mid level commands, for sending data/cmds */
 
@@ -919,8 +2606,11 @@ inline size_t lcd_write(uint8_t value) {
 // write either command or data, with automatic 4/8-bit selection
 void lcd_send(uint8_t value, uint8_t mode) {
   //RS Pin
-  LCD_RS_PORT &= ~(1 << LCD_RS_PIN);
-  LCD_RS_PORT |= (!!mode << LCD_RS_PIN);
+  #if LCD_USING_I2C
+    _lcd_i2c_rs = mode ? LCD_I2C_RS : 0;
+  #else
+  PUT_BIT(LCD_RS_PORT, LCD_RS_PIN, mode);
+  #endif
 
   if (LCD_USING_4PIN_MODE) {
     lcd_write4bits(value>>4);
@@ -941,62 +2631,117 @@ void lcd_pulseEnable(void) {
 }
 
 void lcd_write4bits(uint8_t value) {
+  #if LCD_USING_I2C
+    // queue the nibble with enable high then low, the time taken to send each byte (90us at 100kHz)
+    // covers the enable pulse width and the time commands need to settle
+    uint8_t data = (value << 4) | _lcd_i2c_rs | LCD_I2C_BACKLIGHT;
+    lcd_i2c_queue(data | LCD_I2C_ENABLE);
+    lcd_i2c_queue(data);
+  #else
   //Set each wire one at a time
 
-  LCD_DATA4_PORT &= ~(1 << LCD_DATA4_PIN);
-  LCD_DATA4_PORT |= ((value & 1) << LCD_DATA4_PIN);
-  value >>= 1;
-
-  LCD_DATA5_PORT &= ~(1 << LCD_DATA5_PIN);
-  LCD_DATA5_PORT |= ((value & 1) << LCD_DATA5_PIN);
-  value >>= 1;
-
-  LCD_DATA6_PORT &= ~(1 << LCD_DATA6_PIN);
-  LCD_DATA6_PORT |= ((value & 1) << LCD_DATA6_PIN);
-  value >>= 1;
-
-  LCD_DATA7_PORT &= ~(1 << LCD_DATA7_PIN);
-  LCD_DATA7_PORT |= ((value & 1) << LCD_DATA7_PIN);
+  PUT_BIT(LCD_DATA4_PORT, LCD_DATA4_PIN, value & 1);
+  PUT_BIT(LCD_DATA5_PORT, LCD_DATA5_PIN, value & 2);
+  PUT_BIT(LCD_DATA6_PORT, LCD_DATA6_PIN, value & 4);
+  PUT_BIT(LCD_DATA7_PORT, LCD_DATA7_PIN, value & 8);
 
   lcd_pulseEnable();
+  #endif
 }
 
 void lcd_write8bits(uint8_t value) {
   //Set each wire one at a time
 
   #if !LCD_USING_4PIN_MODE
-    LCD_DATA0_PORT &= ~(1 << LCD_DATA0_PIN);
-    LCD_DATA0_PORT |= ((value & 1) << LCD_DATA0_PIN);
-    value >>= 1;
-
-    LCD_DATA1_PORT &= ~(1 << LCD_DATA1_PIN);
-    LCD_DATA1_PORT |= ((value & 1) << LCD_DATA1_PIN);
-    value >>= 1;
+    PUT_BIT(LCD_DATA0_PORT, LCD_DATA0_PIN, value & 0x01);
+    PUT_BIT(LCD_DATA1_PORT, LCD_DATA1_PIN, value & 0x02);
+    PUT_BIT(LCD_DATA2_PORT, LCD_DATA2_PIN, value & 0x04);
+    PUT_BIT(LCD_DATA3_PORT, LCD_DATA3_PIN, value & 0x08);
+    PUT_BIT(LCD_DATA4_PORT, LCD_DATA4_PIN, value & 0x10);
+    PUT_BIT(LCD_DATA5_PORT, LCD_DATA5_PIN, value & 0x20);
+    PUT_BIT(LCD_DATA6_PORT, LCD_DATA6_PIN, value & 0x40);
+    PUT_BIT(LCD_DATA7_PORT, LCD_DATA7_PIN, value & 0x80);
+    
+    lcd_pulseEnable();
+  #endif
+}
 
-    LCD_DATA2_PORT &= ~(1 << LCD_DATA2_PIN);
-    LCD_DATA2_PORT |= ((value & 1) << LCD_DATA2_PIN);
-    value >>= 1;
+// wait until everything sent to the LCD has actually reached it (only the I2C transport queues data)
+void lcd_flush(void) {
+  #if LCD_USING_I2C
+    while (_lcd_i2c_busy) {
+      // the TWI interrupt can't run if this is called from an ISR, so drive the transfer from here
+      if (!BIT_IS_SET(SREG, SREG_I) && BIT_IS_SET(TWCR, TWINT)) {
+        lcd_i2c_service();
+      }
+    }
+  #endif
+}
 
-    LCD_DATA3_PORT &= ~(1 << LCD_DATA3_PIN);
-    LCD_DATA3_PORT |= ((value & 1) << LCD_DATA3_PIN);
-    value >>= 1;
+#if LCD_USING_I2C
+/************ PCF8574 I2C backpack transport **********/
 
-    LCD_DATA4_PORT &= ~(1 << LCD_DATA4_PIN);
-    LCD_DATA4_PORT |= ((value & 1) << LCD_DATA4_PIN);
-    value >>= 1;
+void lcd_i2c_init(void) {
+  // SCL frequency = F_CPU / (16 + 2 * TWBR * prescaler), prescaler of 1
+  TWSR = 0;
+  TWBR = ((F_CPU / LCD_I2C_CLOCK) - 16) / 2;
+  TWCR = (1 << TWEN);
+}
 
-    LCD_DATA5_PORT &= ~(1 << LCD_DATA5_PIN);
-    LCD_DATA5_PORT |= ((value & 1) << LCD_DATA5_PIN);
-    value >>= 1;
+// add a byte for the PCF8574 outputs to the queue and start a transfer if the bus is idle
+// only waits if the queue is full
+void lcd_i2c_queue(uint8_t data) {
+  uint8_t next = (_lcd_i2c_head + 1) & (LCD_I2C_QUEUE_SIZE - 1);
+  while (next == _lcd_i2c_tail) {
+    if (!BIT_IS_SET(SREG, SREG_I) && BIT_IS_SET(TWCR, TWINT)) {
+      lcd_i2c_service();
+    }
+  }
+  _lcd_i2c_queue[_lcd_i2c_head] = data;
+  _lcd_i2c_head = next;
+  if (!_lcd_i2c_busy) {
+    _lcd_i2c_busy = 1;
+    // let the previous stop condition finish then send a start condition, the rest is done by the TWI interrupt
+    while (BIT_IS_SET(TWCR, TWSTO));
+    TWCR = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE);
+  }
+}
 
-    LCD_DATA6_PORT &= ~(1 << LCD_DATA6_PIN);
-    LCD_DATA6_PORT |= ((value & 1) << LCD_DATA6_PIN);
-    value >>= 1;
+// move the transfer on by one step, all queued bytes are sent in a single write transaction
+static inline void lcd_i2c_service(void) {
+  switch (TWSR & 0xF8) {
+    // start or repeated start sent, address the backpack
+    case 0x08:
+    case 0x10:
+      TWDR = LCD_I2C_ADDRESS << 1;
+      TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
+      break;
+    // address or data byte acknowledged, send the next byte or stop once the queue is empty
+    case 0x18:
+    case 0x28:
+      if (_lcd_i2c_tail != _lcd_i2c_head) {
+        TWDR = _lcd_i2c_queue[_lcd_i2c_tail];
+        _lcd_i2c_tail = (_lcd_i2c_tail + 1) & (LCD_I2C_QUEUE_SIZE - 1);
+        TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
+        break;
+      }
+      TWCR = (1 << TWINT) | (1 << TWSTO) | (1 << TWEN);
+      _lcd_i2c_busy = 0;
+      break;
+    // no acknowledge or bus error, give up on what is queued so the program can't get stuck
+    default:
+      if (_lcd_i2c_errors != 0xFF) {
+        _lcd_i2c_errors++;
+      }
+      _lcd_i2c_tail = _lcd_i2c_head;
+      TWCR = (1 << TWINT) | (1 << TWSTO) | (1 << TWEN);
+      _lcd_i2c_busy = 0;
+      break;
+  }
+}
 
-    LCD_DATA7_PORT &= ~(1 << LCD_DATA7_PIN);
-    LCD_DATA7_PORT |= ((value & 1) << LCD_DATA7_PIN);
-    
-    lcd_pulseEnable();
-  #endif
+ISR(TWI_vect) {
+  lcd_i2c_service();
 }
+#endif
 
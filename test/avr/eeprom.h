@@ -0,0 +1,9 @@
+// host stand-in for avr/eeprom.h: EEMEM variables are ordinary variables
+#ifndef HOST_AVR_EEPROM_H
+#define HOST_AVR_EEPROM_H
+#include <stdint.h>
+
+#define EEMEM
+#define eeprom_read_byte(address) (*(const uint8_t *)(address))
+#define eeprom_update_byte(address, value) (*(uint8_t *)(address) = (value))
+#endif
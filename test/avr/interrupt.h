@@ -0,0 +1,11 @@
+// host stand-in for avr/interrupt.h: an ISR is a plain function that the test or simulation calls through
+// host_interrupt(), and the global interrupt flag is the I bit of the SREG variable
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+#include "../host.h"
+
+#define ISR(vector, ...) void vector(void); void vector(void)
+#define ISR_NOBLOCK
+#define sei() host_sei()
+#define cli() ((void)host_cli())
+#endif
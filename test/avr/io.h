@@ -0,0 +1,40 @@
+// host stand-in for avr/io.h: the ATmega328P registers used by the nightlight as plain variables (see host.c)
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+#include <stdint.h>
+#include <stddef.h>
+#include "../host.h"
+
+#define R8(name) extern volatile uint8_t name;
+#define R16(name) extern volatile uint16_t name;
+R8(DDRB) R8(DDRC) R8(DDRD) R8(PORTB) R8(PORTC) R8(PORTD) R8(PINB) R8(PINC) R8(PIND)
+R8(TCCR0A) R8(TCCR0B) R8(TIMSK0) R8(TCNT0) R8(TIFR0)
+R8(TCCR1A) R8(TCCR1B) R8(TIMSK1) R16(OCR1A) R8(TIFR1)
+R8(TCCR2A) R8(TCCR2B) R8(TIMSK2) R8(OCR2A) R8(OCR2B) R8(TCNT2) R8(TIFR2)
+R8(ADMUX) R8(ADCSRB) R16(ADC) R8(DIDR0)
+R8(UCSR0A) R8(UCSR0B) R8(UCSR0C) R16(UBRR0) R8(UDR0)
+R8(MCUSR) R8(WDTCSR) R8(SREG)
+R8(TWBR) R8(TWSR) R8(TWDR) R8(TWAR)
+#undef R8
+#undef R16
+// timer 1 is read in busy loops (the LCD power up wait) so it goes through host_tcnt1(), which a simulation can
+// keep counting
+#define TCNT1 (*host_tcnt1())
+// ADCSRA (ADSC) and TWCR (TWINT and TWSTO) are polled the same way and go through host_adcsra() and host_twcr() so a
+// model of the ADC or TWI can act on them
+#define ADCSRA (*host_adcsra())
+#define TWCR (*host_twcr())
+
+enum {
+	CS00 = 0, CS01 = 1, CS02 = 2, TOIE0 = 0, WGM00 = 0, WGM01 = 1,
+	CS10 = 0, CS11 = 1, CS12 = 2, WGM12 = 3, WGM13 = 4, WGM10 = 0, WGM11 = 1, OCIE1A = 1, TOIE1 = 0, OCF1A = 1, TOV1 = 0,
+	COM2A1 = 7, COM2A0 = 6, CS20 = 0, CS21 = 1, CS22 = 2, WGM20 = 0, WGM21 = 1, WGM22 = 3, TOIE2 = 0, OCIE2A = 1, TOV2 = 0,
+	REFS0 = 6, REFS1 = 7, ADLAR = 5, MUX0 = 0, MUX1 = 1, MUX2 = 2, MUX3 = 3,
+	ADEN = 7, ADSC = 6, ADATE = 5, ADIF = 4, ADIE = 3, ADPS2 = 2, ADPS1 = 1, ADPS0 = 0,
+	RXCIE0 = 7, TXCIE0 = 6, UDRIE0 = 5, RXEN0 = 4, TXEN0 = 3, UCSZ02 = 2,
+	UCSZ01 = 2, UCSZ00 = 1, UPM01 = 5, UPM00 = 4,
+	RXC0 = 7, TXC0 = 6, UDRE0 = 5, FE0 = 4, DOR0 = 3, UPE0 = 2, U2X0 = 1, MPCM0 = 0,
+	SREG_I = 7, PORF = 0, EXTRF = 1, BORF = 2, WDRF = 3,
+	TWINT = 7, TWEA = 6, TWSTA = 5, TWSTO = 4, TWWC = 3, TWEN = 2, TWIE = 0, TWPS0 = 0, TWPS1 = 1,
+};
+#endif
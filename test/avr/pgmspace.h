@@ -0,0 +1,12 @@
+// host stand-in for avr/pgmspace.h: program memory is ordinary memory
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+#define strcmp_P(s1, s2) strcmp((s1), (s2))
+#endif
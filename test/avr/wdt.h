@@ -0,0 +1,13 @@
+// host stand-in for avr/wdt.h: there is no watchdog
+#ifndef HOST_AVR_WDT_H
+#define HOST_AVR_WDT_H
+
+#define WDTO_15MS 0
+#define WDTO_250MS 4
+#define WDTO_500MS 5
+#define WDTO_1S 6
+#define WDTO_2S 7
+#define wdt_enable(timeout) ((void)(timeout))
+#define wdt_disable()
+#define wdt_reset()
+#endif
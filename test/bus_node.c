@@ -0,0 +1,55 @@
+// one unit on the simulated bus: runs the nightlight in bus mode in simulated time (see simulate.h) and trades what
+// is on the line with test/bus_sim.py once every frame time, so all the units on the bus keep in step.
+// usage: bus_node <id>
+// It first writes "bus_node <id> <frame time in ns>\n", then at the end of each frame time writes 2 bytes (1 and the
+// byte it sent during the frame, or 0 0) and reads 2 bytes back (1 and the byte that was on the bus, or 0 0). At the
+// end of its input it writes "bus_node <id> overruns <count>\n" and exits
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define BUS_MODE (1)
+#include "sketch.h"
+#include "simulate.h"
+
+static uint64_t frame_end = UART_FRAME_CYCLES;
+static uint8_t frame_sent[2];
+
+static void simulate_transmit(uint8_t data) {
+	frame_sent[0] = 1;
+	frame_sent[1] = data;
+}
+
+static uint64_t simulate_due(void) {
+	return frame_end;
+}
+
+static void simulate_step(void) {
+	if (now < frame_end) {
+		return;
+	}
+	frame_end += UART_FRAME_CYCLES;
+	uint8_t line[2];
+	if (write(STDOUT_FILENO, frame_sent, 2) != 2 || read(STDIN_FILENO, line, 2) != 2) {
+		printf("bus_node %u overruns %lu\n", bus_id, uart_overruns);
+		exit(0);
+	}
+	frame_sent[0] = 0;
+	frame_sent[1] = 0;
+	if (line[0]) {
+		simulate_receive(line[1]);
+		run_interrupts();
+	}
+}
+
+int main(int argc, char *argv[]) {
+	if (argc != 2 || atoi(argv[1]) < 1 || atoi(argv[1]) > BUS_MAX_ID) {
+		fprintf(stderr, "usage: %s <id>\n", argv[0]);
+		return 2;
+	}
+	eeprom_update_byte(&bus_id_eeprom, atoi(argv[1]));
+	printf("bus_node %u %lu\n", atoi(argv[1]), UART_FRAME_CYCLES * 1000UL / CYCLES_PER_US);
+	fflush(stdout);
+	nightlight_main();
+	return 0;
+}
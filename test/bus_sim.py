@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+# runs several units on a simulated half-duplex bus (see test/bus_node.c) with this script as the host, and measures
+# what the polling costs: each unit gets polled in turn for a number of rounds, then a broadcast starts them all
+# dimming and another round checks they all did. Everything is in simulated time, one step per frame time. A byte
+# sent by more than one transmitter in the same frame is a collision and nobody receives it. Prints the throughput
+# and the latency from the end of a poll to its reply, and exits with 1 if a poll went unanswered or was answered
+# wrongly, anything collided, a unit answered a broadcast or a unit lost a received byte
+#   test/bus_sim.py [--units N] [--rounds N] [--node test/build/bus_node]
+import argparse
+import os
+import re
+import subprocess
+import sys
+
+# how long the host waits for a reply before moving on to the next unit
+REPLY_TIMEOUT_MS = 20
+# how long the units get to boot before the first poll
+BOOT_MS = 200
+REPLY = re.compile(r"#(\d+) (idle|on|dimming) (\d+) (\d+)\n$")
+
+
+class Bus:
+    def __init__(self, node, ids):
+        self.units = []
+        for unit_id in ids:
+            process = subprocess.Popen([node, str(unit_id)], stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                                       bufsize=0)
+            header = process.stdout.readline().split()
+            self.units.append((unit_id, process))
+            self.frame_ns = int(header[2])
+        self.frames = 0
+        self.collisions = 0
+        self.busy_frames = 0
+        self.unit_bytes = {unit_id: 0 for unit_id in ids}
+
+    def ms(self, frames):
+        return frames * self.frame_ns / 1e6
+
+    # one frame time: returns the byte on the bus (None if it was idle or there was a collision)
+    def step(self, host_byte=None):
+        sent = []
+        if host_byte is not None:
+            sent.append(("host", host_byte))
+        for unit_id, process in self.units:
+            frame = os.read(process.stdout.fileno(), 2)
+            if len(frame) != 2:
+                sys.exit("bus_sim: unit %u stopped" % unit_id)
+            if frame[0]:
+                sent.append((unit_id, frame[1]))
+                self.unit_bytes[unit_id] += 1
+        self.frames += 1
+        on_bus = None
+        if len(sent) > 1:
+            self.collisions += 1
+        elif sent:
+            on_bus = sent[0]
+            self.busy_frames += 1
+        for unit_id, process in self.units:
+            # a transmitter doesn't hear itself
+            if on_bus is not None and on_bus[0] != unit_id:
+                os.write(process.stdin.fileno(), bytes([1, on_bus[1]]))
+            else:
+                os.write(process.stdin.fileno(), bytes([0, 0]))
+        if on_bus is None or on_bus[0] == "host":
+            return None
+        return on_bus[1]
+
+    def idle(self, ms):
+        received = bytearray()
+        for _ in range(int(ms * 1e6 / self.frame_ns)):
+            byte = self.step()
+            if byte is not None:
+                received.append(byte)
+        return received
+
+    # send a line, returns the frame its last byte went out in
+    def send(self, line):
+        for byte in line.encode():
+            self.step(byte)
+        return self.frames
+
+    # what comes back before the line ends or the timeout, and the frames of its first and last bytes
+    def receive_line(self, timeout_ms):
+        received = bytearray()
+        first = last = None
+        for _ in range(int(timeout_ms * 1e6 / self.frame_ns)):
+            byte = self.step()
+            if byte is not None:
+                received.append(byte)
+                first = first or self.frames
+                last = self.frames
+                if byte == ord("\n"):
+                    break
+        return received.decode(errors="replace"), first, last
+
+    def close(self):
+        overruns = {}
+        for unit_id, process in self.units:
+            process.stdin.close()
+            words = process.stdout.read().split()
+            process.wait()
+            overruns[unit_id] = int(words[-1]) if words else None
+        return overruns
+
+
+def poll_round(bus, ids, state, latencies, problems):
+    for unit_id in ids:
+        sent = bus.send("@%u poll\n" % unit_id)
+        reply, first, last = bus.receive_line(REPLY_TIMEOUT_MS)
+        match = REPLY.match(reply)
+        if not match or int(match.group(1)) != unit_id:
+            problems.append("poll of unit %u got %r" % (unit_id, reply))
+            continue
+        if match.group(2) != state:
+            problems.append("unit %u is %s, expected %s" % (unit_id, match.group(2), state))
+        latencies.append((bus.ms(first - sent), bus.ms(last - sent)))
+
+
+def percentile(values, fraction):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(fraction * len(values)))]
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--units", type=int, default=4)
+    parser.add_argument("--rounds", type=int, default=5)
+    parser.add_argument("--node", default="test/build/bus_node")
+    args = parser.parse_args()
+    ids = list(range(1, args.units + 1))
+    bus = Bus(args.node, ids)
+    problems = []
+    bus.idle(BOOT_MS)
+    if bus.busy_frames:
+        problems.append("%u bytes sent while booting" % bus.busy_frames)
+
+    latencies = []
+    start = bus.frames
+    busy = bus.busy_frames
+    for _ in range(args.rounds):
+        poll_round(bus, ids, "idle", latencies, problems)
+    polling_ms = bus.ms(bus.frames - start)
+    busy = bus.busy_frames - busy
+
+    # a broadcast is never answered, then every unit should be dimming
+    bus.send("@* dim 600\n")
+    answered = bus.idle(REPLY_TIMEOUT_MS)
+    if answered:
+        problems.append("broadcast answered with %r" % answered.decode(errors="replace"))
+    poll_round(bus, ids, "dimming", latencies, problems)
+    bus.send("@* off\n")
+    bus.idle(REPLY_TIMEOUT_MS)
+    poll_round(bus, ids, "idle", latencies, problems)
+
+    overruns = bus.close()
+    if bus.collisions:
+        problems.append("%u collisions" % bus.collisions)
+    for unit_id, count in overruns.items():
+        if count != 0:
+            problems.append("unit %u lost %s received bytes" % (unit_id, count))
+
+    polls = args.units * args.rounds
+    first = [latency[0] for latency in latencies]
+    last = [latency[1] for latency in latencies]
+    print("bus: %u units, frame %.1f us, %.0f ms simulated" % (args.units, bus.frame_ns / 1e3, bus.ms(bus.frames)))
+    print("  polling: %u polls in %.1f ms, %.0f polls/s (a full round every %.1f ms), bus busy %.1f%%" % (
+        polls, polling_ms, polls * 1000 / polling_ms, polling_ms / args.rounds, 100 * busy / (polling_ms * 1e6 /
+        bus.frame_ns)))
+    if latencies:
+        print("  latency from the end of a poll: first byte of the reply median %.2f ms, max %.2f ms; whole reply"
+            " median %.2f ms, max %.2f ms" % (percentile(first, 0.5), max(first), percentile(last, 0.5), max(last)))
+    for problem in problems[:10]:
+        print("  " + problem)
+    print("bus_sim: %s" % ("%u problems" % len(problems) if problems else "ok"))
+    return 1 if problems else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,26 @@
+// checks for the host tests: CHECK() prints the failure with where it was and counts it, check_result() prints the
+// result and returns the exit status for main()
+#ifndef CHECK_H
+#define CHECK_H
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(condition, ...) do { \
+	if (!(condition)) { \
+		printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		failures++; \
+	} \
+} while (0)
+
+static int check_result(const char *test) {
+	if (failures != 0) {
+		printf("%s: %d failures\n", test, failures);
+		return 1;
+	}
+	printf("%s: ok\n", test);
+	return 0;
+}
+#endif
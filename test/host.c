@@ -0,0 +1,114 @@
+// registers and interrupt flag for building the nightlight on the host (see host.h)
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include "avr/io.h"
+
+#define R8(name) volatile uint8_t name;
+#define R16(name) volatile uint16_t name;
+R8(DDRB) R8(DDRC) R8(DDRD) R8(PORTB) R8(PORTC) R8(PORTD) R8(PINB) R8(PINC) R8(PIND)
+R8(TCCR0A) R8(TCCR0B) R8(TIMSK0) R8(TCNT0) R8(TIFR0)
+R8(TCCR1A) R8(TCCR1B) R8(TIMSK1) R16(OCR1A) R8(TIFR1)
+R8(TCCR2A) R8(TCCR2B) R8(TIMSK2) R8(OCR2A) R8(OCR2B) R8(TCNT2) R8(TIFR2)
+R8(ADMUX) R8(ADCSRB) R16(ADC) R8(DIDR0)
+R8(UCSR0A) R8(UCSR0B) R8(UCSR0C) R16(UBRR0) R8(UDR0)
+R8(MCUSR) R8(WDTCSR) R8(SREG)
+R8(TWBR) R8(TWSR) R8(TWDR) R8(TWAR)
+
+int host_interrupt_signal = 0;
+static volatile uint16_t timer1_count;
+static volatile uint8_t adc_control;
+static volatile uint16_t twi_control;
+static timer_t interrupt_timer;
+static uint8_t interrupt_timer_created = 0;
+static void (*volatile interrupt_handler)(void) = NULL;
+
+static void block_interrupts(int how) {
+	if (host_interrupt_signal != 0) {
+		sigset_t set;
+		sigemptyset(&set);
+		sigaddset(&set, host_interrupt_signal);
+		pthread_sigmask(how, &set, NULL);
+	}
+}
+
+uint8_t host_cli(void) {
+	// block first so an interrupt can't come in between reading and clearing the flag
+	block_interrupts(SIG_BLOCK);
+	uint8_t sreg = SREG;
+	SREG = sreg & ~(1 << SREG_I);
+	return sreg;
+}
+
+void host_restore(const uint8_t *sreg) {
+	if (*sreg & (1 << SREG_I)) {
+		host_sei();
+	}
+}
+
+void host_sei(void) {
+	SREG |= 1 << SREG_I;
+	// a pending signal is taken here, like a pending interrupt after sei
+	block_interrupts(SIG_UNBLOCK);
+	host_interrupts_enabled();
+}
+
+void host_interrupt(void (*isr)(void)) {
+	uint8_t sreg = SREG;
+	SREG = sreg & ~(1 << SREG_I);
+	isr();
+	SREG = sreg;
+}
+
+__attribute__((weak)) void host_delay_us(double us) {
+	(void)us;
+}
+
+__attribute__((weak)) void host_interrupts_enabled(void) {
+}
+
+__attribute__((weak)) volatile uint16_t *host_tcnt1(void) {
+	return &timer1_count;
+}
+
+__attribute__((weak)) volatile uint8_t *host_adcsra(void) {
+	return &adc_control;
+}
+
+__attribute__((weak)) volatile uint16_t *host_twcr(void) {
+	return &twi_control;
+}
+
+static void on_interrupt_timer(int signal) {
+	(void)signal;
+	if (interrupt_handler != NULL) {
+		interrupt_handler();
+	}
+}
+
+void host_timer_start(void (*handler)(void), long period_ns) {
+	if (!interrupt_timer_created) {
+		host_interrupt_signal = SIGUSR1;
+		struct sigaction action = {0};
+		action.sa_handler = on_interrupt_timer;
+		action.sa_flags = SA_RESTART;
+		sigaction(SIGUSR1, &action, NULL);
+		struct sigevent event = {0};
+		event.sigev_notify = SIGEV_SIGNAL;
+		event.sigev_signo = SIGUSR1;
+		timer_create(CLOCK_MONOTONIC, &event, &interrupt_timer);
+		interrupt_timer_created = 1;
+		if (!(SREG & (1 << SREG_I))) {
+			block_interrupts(SIG_BLOCK);
+		}
+	}
+	interrupt_handler = handler;
+	struct itimerspec period = {{0, period_ns}, {0, period_ns}};
+	timer_settime(interrupt_timer, 0, &period, NULL);
+}
+
+void host_timer_stop(void) {
+	struct itimerspec off = {{0, 0}, {0, 0}};
+	timer_settime(interrupt_timer, 0, &off, NULL);
+	interrupt_handler = NULL;
+}
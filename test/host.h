@@ -0,0 +1,30 @@
+// support for building the nightlight on the host (see the stand-in headers in test/avr and test/util)
+#ifndef HOST_H
+#define HOST_H
+#include <stdint.h>
+
+// the global interrupt flag: host_cli() clears it and returns the SREG it replaced, host_restore() puts the I bit back
+// and host_sei() sets it. If host_interrupt_signal is set, that signal is blocked while the flag is clear so a test
+// can deliver interrupts from another thread at any point the real ones could happen
+extern int host_interrupt_signal;
+uint8_t host_cli(void);
+void host_restore(const uint8_t *sreg);
+void host_sei(void);
+// run an ISR the way the hardware does, with the I bit clear until it returns
+void host_interrupt(void (*isr)(void));
+
+// hooks a simulation can replace: host_delay_us() is called by _delay_us()/_delay_ms(), host_interrupts_enabled()
+// each time the I bit is set, and host_tcnt1(), host_adcsra() and host_twcr() for every timer 1, ADCSRA and TWCR
+// access. By default delays take no time, timer 1 doesn't count and ADCSRA and TWCR are plain registers that nothing
+// answers. TWCR is 16 bits so a model has room for flags of its own above the real ones
+void host_delay_us(double us);
+void host_interrupts_enabled(void);
+volatile uint16_t *host_tcnt1(void);
+volatile uint8_t *host_adcsra(void);
+volatile uint16_t *host_twcr(void);
+
+// call handler() from a signal every period_ns, with host_interrupt_signal set up so the signal is held off while the
+// I bit is clear. The handler runs where an interrupt could, and runs ISRs with host_interrupt()
+void host_timer_start(void (*handler)(void), long period_ns);
+void host_timer_stop(void);
+#endif
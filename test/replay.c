@@ -0,0 +1,113 @@
+// trace replay: runs the nightlight in simulated time (see simulate.h) with its inputs (serial bytes, ADC readings
+// and button levels) taken from the R, A and B records of a recorded trace, and writes its serial output, trace
+// records included, to stdout. test/replay.py compares that with the recording.
+// usage: replay <trace file>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TRACE_ENABLED (1)
+#define TRACE_REPLAY (1)
+#include "sketch.h"
+#include "simulate.h"
+
+// carry on for this many ticks after the last record so the output that follows it is compared too
+#define END_TICKS 2000
+
+struct record {
+	uint32_t tick;
+	uint16_t value;
+};
+
+static struct record *bytes, *readings, *levels;
+static size_t byte_count, reading_count, level_count;
+static size_t next_byte, next_reading, next_level;
+static uint32_t end_tick;
+
+static void add_record(struct record **records, size_t *count, uint32_t tick, uint16_t value) {
+	*records = realloc(*records, (*count + 1) * sizeof(struct record));
+	(*records)[*count].tick = tick;
+	(*records)[*count].value = value;
+	(*count)++;
+}
+
+static void load_trace(const char *path) {
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		perror(path);
+		exit(2);
+	}
+	char line[256];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		// a record can follow output that didn't end with a newline
+		for (char *record = strchr(line, '~'); record != NULL; record = strchr(record + 1, '~')) {
+			unsigned long tick;
+			char kind;
+			unsigned value;
+			if (sscanf(record, "~%lu %c %u", &tick, &kind, &value) != 3) {
+				continue;
+			}
+			if (kind == 'R') {
+				add_record(&bytes, &byte_count, tick, value);
+			}
+			else if (kind == 'A') {
+				add_record(&readings, &reading_count, tick, value);
+			}
+			else if (kind == 'B') {
+				add_record(&levels, &level_count, tick, value);
+			}
+			if (tick + END_TICKS > end_tick) {
+				end_tick = tick + END_TICKS;
+			}
+		}
+	}
+	fclose(file);
+}
+
+uint8_t replay_byte(uint32_t tick, unsigned char *data) {
+	if (next_byte == byte_count || bytes[next_byte].tick > tick) {
+		return 0;
+	}
+	*data = bytes[next_byte++].value;
+	return 1;
+}
+
+uint16_t replay_adc(void) {
+	if (next_reading == reading_count) {
+		fprintf(stderr, "replay: more ADC readings taken than were recorded\n");
+		return reading_count == 0 ? 0 : readings[reading_count - 1].value;
+	}
+	return readings[next_reading++].value;
+}
+
+uint8_t replay_button(uint32_t tick) {
+	static uint8_t level = 0;
+	while (next_level < level_count && levels[next_level].tick <= tick) {
+		level = levels[next_level++].value;
+	}
+	return level;
+}
+
+static void simulate_transmit(uint8_t data) {
+	putchar(data);
+}
+
+static uint64_t simulate_due(void) {
+	return UINT64_MAX;
+}
+
+static void simulate_step(void) {
+	if (trace_ticks > end_tick) {
+		fflush(stdout);
+		exit(0);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+		return 2;
+	}
+	load_trace(argv[1]);
+	nightlight_main();
+	return 0;
+}
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+# replays recorded traces (see TRACE_ENABLED in the sketch) through the host build of the nightlight and compares
+# what it does with the recording: every "~<tick> <kind> <data>" record must come out again with the same data within
+# the tick tolerance, and the normal serial output must be the same. Reports how far the timing of each kind of record
+# moved, and exits with 1 if anything differs
+#   test/replay.py [--tolerance TICKS] [--replay test/build/replay] TRACE...
+import argparse
+import re
+import subprocess
+import sys
+
+RECORD = re.compile(r"~(\d+) (\S)(?: (.*))?$")
+# how many differences to print per trace
+SHOWN = 10
+
+
+# split a trace into its records (tick, kind, data) and the normal serial output around them
+def parse(text):
+    records = []
+    output = []
+    for line in text.replace("\r", "").split("\n"):
+        # a record can follow output that didn't end with a newline
+        start = line.find("~")
+        match = RECORD.match(line[start:]) if start >= 0 else None
+        if match:
+            output.append(line[:start])
+            records.append((int(match.group(1)), match.group(2), match.group(3) or ""))
+        else:
+            output.append(line + "\n")
+    return records, "".join(output)
+
+
+def by_kind(records):
+    kinds = {}
+    for tick, kind, data in records:
+        kinds.setdefault(kind, []).append((tick, data))
+    return kinds
+
+
+# where the normal serial output first differs
+def first_difference(recorded, replayed):
+    recorded = recorded.split("\n")
+    replayed = replayed.split("\n")
+    for line, (want, got) in enumerate(zip(recorded, replayed), 1):
+        if want != got:
+            return f"serial output line {line}: \"{want}\" replayed as \"{got}\""
+    return f"serial output has {len(recorded)} lines recorded, {len(replayed)} replayed"
+
+
+def compare(path, replayed_text, tolerance):
+    with open(path) as file:
+        recorded, recorded_output = parse(file.read())
+    replayed, replayed_output = parse(replayed_text)
+    expected = by_kind(recorded)
+    actual = by_kind(replayed)
+    problems = []
+    print(f"{path}:")
+    for kind in sorted(set(expected) | set(actual)):
+        want = expected.get(kind, [])
+        got = actual.get(kind, [])
+        deviations = []
+        for i, ((want_tick, want_data), (got_tick, got_data)) in enumerate(zip(want, got)):
+            if want_data != got_data:
+                problems.append(f"{kind} record {i + 1}: ~{want_tick} {kind} {want_data} replayed as "
+                                f"~{got_tick} {kind} {got_data}")
+                continue
+            deviation = got_tick - want_tick
+            deviations.append(deviation)
+            if abs(deviation) > tolerance:
+                problems.append(f"{kind} record {i + 1}: ~{want_tick} {kind} {want_data} replayed at ~{got_tick} "
+                                f"({deviation:+d} ticks)")
+        if len(want) != len(got):
+            problems.append(f"{len(want)} {kind} records recorded, {len(got)} replayed")
+        if deviations:
+            worst = max(deviations, key=abs)
+            mean = sum(abs(d) for d in deviations) / len(deviations)
+            print(f"  {kind}: {len(deviations)} records, timing deviation worst {worst:+d} mean {mean:.2f} ticks")
+    if recorded_output != replayed_output:
+        problems.append(first_difference(recorded_output, replayed_output))
+    for problem in problems[:SHOWN]:
+        print(f"  DIFFERS {problem}")
+    if len(problems) > SHOWN:
+        print(f"  ... and {len(problems) - SHOWN} more")
+    return not problems
+
+
+def main():
+    parser = argparse.ArgumentParser(description="replay nightlight traces and compare them with the recording")
+    parser.add_argument("--tolerance", type=int, default=2, help="ticks a record can move by (default 2)")
+    parser.add_argument("--replay", default="test/build/replay", help="the replay harness (default test/build/replay)")
+    parser.add_argument("traces", nargs="+")
+    args = parser.parse_args()
+    ok = True
+    for path in args.traces:
+        run = subprocess.run([args.replay, path], capture_output=True, text=True, timeout=600)
+        if run.returncode != 0:
+            print(f"{path}: replay failed ({run.returncode})\n{run.stderr}")
+            ok = False
+            continue
+        sys.stderr.write(run.stderr)
+        ok = compare(path, run.stdout, args.tolerance) and ok
+    print("replay: ok" if ok else "replay: traces differ")
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,194 @@
+// the nightlight in simulated time, shared by the replay and bus simulation builds. Include it after sketch.h and
+// define the hooks below.
+// Time only moves on in delays, each time the interrupts are enabled (about what a busy loop takes to go round), each
+// time timer 1 is read and while a conversion is waited for. The timer 0, timer 1 compare, timer 2, receive complete
+// (bus mode) and data register empty interrupts run when they are due and the interrupts are enabled, the
+// transmitter sends one byte per frame time at BAUD_RATE and an ADC conversion takes 13 ADC clocks
+#ifndef SIMULATE_H
+#define SIMULATE_H
+#include <stdint.h>
+
+#define CYCLES_PER_US (F_CPU / 1000000)
+#define TIMER0_CYCLES (TIMER0_PRESCALER * 256UL)
+#define TIMER1_CYCLES 1024UL
+#define TIMER2_CYCLES (8 * 256UL)
+#define UART_FRAME_CYCLES (F_CPU * 10 / BAUD_RATE)
+#define ADC_CONVERSION_CYCLES (13 * 128UL)
+
+// hooks: simulate_transmit() gets each byte the transmitter sends, simulate_due() says when the includer next wants
+// simulate_step() called (it is also called whenever anything else happens)
+static void simulate_transmit(uint8_t data);
+static uint64_t simulate_due(void);
+static void simulate_step(void);
+
+// simulated time in cycles since reset and when each interrupt is next due
+static uint64_t now;
+static uint64_t timer0_due = TIMER0_CYCLES;
+static uint64_t timer2_due = TIMER2_CYCLES;
+static uint64_t uart_due;
+static uint64_t adc_due;
+static uint16_t timer1_count;
+static uint64_t timer1_ticks;
+// interrupts that came due while the I bit was clear, taken as soon as it is set again
+static uint8_t timer0_pending, timer1_pending, timer2_pending;
+static uint8_t in_interrupt;
+// ADCSRA, and what the light sensor reads when the ADC isn't replayed
+static volatile uint8_t adc_control;
+static uint16_t adc_reading = 512;
+#if BUS_MODE
+// a byte received and not yet taken by the receive complete ISR, and bytes lost because the next one came first
+static uint8_t uart_received;
+static uint8_t uart_receive_pending;
+static unsigned long uart_overruns;
+#endif
+
+// bring timer 1 up to date, it counts all the time (normal mode)
+static void timer1_update(void) {
+	uint64_t ticks = now / TIMER1_CYCLES;
+	timer1_count += ticks - timer1_ticks;
+	timer1_ticks = ticks;
+}
+
+// when timer 1 next matches OCR1A
+static uint64_t timer1_due(void) {
+	timer1_update();
+	uint16_t ticks = OCR1A - timer1_count;
+	return (timer1_ticks + (ticks == 0 ? 0x10000 : ticks)) * TIMER1_CYCLES;
+}
+
+#if BUS_MODE
+// a byte has come in on the line, it is lost if the receiver is off
+static void simulate_receive(uint8_t data) {
+	if (!BIT_IS_SET(UCSR0B, RXEN0)) {
+		return;
+	}
+	if (uart_receive_pending) {
+		uart_overruns++;
+	}
+	uart_received = data;
+	uart_receive_pending = 1;
+}
+#endif
+
+// the pins the self test reads back
+static void update_pins(void) {
+	PINC = PORTC;
+	PIND = PORTD;
+	uint8_t bulb = BIT_VALUE(PORTB, BULB_PIN);
+	if (BIT_IS_SET(TCCR2A, COM2A1)) {
+		// fast PWM: high from the bottom of the count up to the compare value
+		bulb = (now / 8 % 256) <= OCR2A;
+	}
+	PINB = (PINB & ~(1 << BULB_PIN)) | (bulb << BULB_PIN);
+	// a conversion that has been started
+	if (BIT_IS_SET(adc_control, ADSC)) {
+		if (adc_due == 0) {
+			adc_due = now + ADC_CONVERSION_CYCLES;
+		}
+		else if (now >= adc_due) {
+			adc_due = 0;
+			ADC = adc_reading;
+			adc_control &= ~(1 << ADSC);
+		}
+	}
+}
+
+static void run_interrupts(void) {
+	if (!BIT_IS_SET(SREG, SREG_I) || in_interrupt) {
+		return;
+	}
+	in_interrupt = 1;
+	// in vector order, like the hardware
+	if (timer2_pending) {
+		timer2_pending = 0;
+		host_interrupt(TIMER2_OVF_vect);
+	}
+	if (timer1_pending) {
+		timer1_pending = 0;
+		host_interrupt(TIMER1_COMPA_vect);
+	}
+	if (timer0_pending) {
+		timer0_pending = 0;
+		host_interrupt(TIMER0_OVF_vect);
+	}
+#if BUS_MODE
+	if (uart_receive_pending && BIT_IS_SET(UCSR0B, RXCIE0)) {
+		uart_receive_pending = 0;
+		UDR0 = uart_received;
+		host_interrupt(USART_RX_vect);
+	}
+#endif
+	if (BIT_IS_SET(UCSR0B, UDRIE0) && uart_due <= now) {
+		host_interrupt(USART_UDRE_vect);
+		simulate_transmit(UDR0);
+		uart_due = now + UART_FRAME_CYCLES;
+	}
+	in_interrupt = 0;
+}
+
+// move simulated time on, taking the interrupts that come due on the way
+static void run(uint64_t cycles) {
+	uint64_t end = now + cycles;
+	while (1) {
+		uint64_t timer1 = timer1_due();
+		uint64_t due = simulate_due();
+		uint64_t next = end;
+		next = timer0_due < next ? timer0_due : next;
+		next = timer1 < next ? timer1 : next;
+		next = timer2_due < next ? timer2_due : next;
+		next = due < next ? due : next;
+		next = adc_due != 0 && adc_due < next ? adc_due : next;
+		if (BIT_IS_SET(UCSR0B, UDRIE0) && BIT_IS_SET(SREG, SREG_I) && !in_interrupt) {
+			uint64_t uart = uart_due > now ? uart_due : now;
+			next = uart < next ? uart : next;
+		}
+		now = next;
+		if (now == timer0_due) {
+			timer0_due += TIMER0_CYCLES;
+			timer0_pending = BIT_IS_SET(TIMSK0, TOIE0);
+		}
+		if (now == timer1) {
+			timer1_update();
+			timer1_pending = BIT_IS_SET(TIMSK1, OCIE1A);
+		}
+		if (now == timer2_due) {
+			timer2_due += TIMER2_CYCLES;
+			timer2_pending = BIT_IS_SET(TIMSK2, TOIE2);
+		}
+		update_pins();
+		run_interrupts();
+		simulate_step();
+		if (now >= end) {
+			return;
+		}
+	}
+}
+
+void host_delay_us(double us) {
+	if (!in_interrupt) {
+		run((uint64_t)(us * CYCLES_PER_US));
+	}
+}
+
+void host_interrupts_enabled(void) {
+	if (!in_interrupt) {
+		run(CYCLES_PER_US);
+	}
+}
+
+// waiting for a conversion to finish
+volatile uint8_t *host_adcsra(void) {
+	if (!in_interrupt && BIT_IS_SET(adc_control, ADSC)) {
+		run(CYCLES_PER_US);
+	}
+	return &adc_control;
+}
+
+volatile uint16_t *host_tcnt1(void) {
+	if (!in_interrupt) {
+		run(CYCLES_PER_US);
+	}
+	timer1_update();
+	return &timer1_count;
+}
+#endif
@@ -0,0 +1,8 @@
+// the nightlight built for the host, with its main() renamed to nightlight_main() so a test can have its own
+// set the sketch's build flags (BUS_MODE, TRACE_ENABLED, ...) before including this
+#ifndef SKETCH_H
+#define SKETCH_H
+#define main nightlight_main
+#include "../nightlight_n10494448_assignment.c"
+#undef main
+#endif
@@ -0,0 +1,142 @@
+// bus mode: lines are fed to the receive ISR a byte at a time, then handled the way the main loop would, and the
+// replies that come out of the transmit ring are checked. Covers addressing (this unit, other units, broadcasts),
+// over-long lines and changing the ID. Built a second time with the I2C LCD (test_bus_i2c), which frees PD6 for the
+// transceiver's driver enable, to check the bus is only driven while a reply goes out
+#include <stdio.h>
+
+#define BUS_MODE (1)
+#include "sketch.h"
+#include "check.h"
+
+#define ID 3
+
+// everything sent since the last bus_line()
+static char replies[256];
+
+// receive a line (without its newline) and handle the command if it was taken, like the main loop does
+// returns what bus_command() returned, or EVENT_NONE if the line wasn't taken
+static uint8_t bus_line(const char *line) {
+	for (const char *c = line; *c != '\0'; c++) {
+		UDR0 = *c;
+		host_interrupt(USART_RX_vect);
+	}
+	UDR0 = '\n';
+	host_interrupt(USART_RX_vect);
+	uint8_t result = EVENT_NONE;
+	uint8_t event = event_get();
+	if (event == EVENT_BUS_COMMAND) {
+		result = bus_command();
+		// "dim", "on" and "off" would clear the light and start it again with bus_start()
+		bus_command_ready = 0;
+	}
+	else {
+		CHECK(event == EVENT_NONE, "event %u after \"%s\"", event, line);
+	}
+	size_t length = 0;
+#if BUS_DRIVER_ENABLE
+	// the transceiver only drives the bus while a reply is going out
+	CHECK(BIT_IS_SET(BUS_DE_PORT, BUS_DE_PIN) == BIT_IS_SET(UCSR0B, UDRIE0), "driver enable %s after \"%s\"",
+		BIT_IS_SET(BUS_DE_PORT, BUS_DE_PIN) ? "on without a reply" : "off with a reply", line);
+#endif
+	while (BIT_IS_SET(UCSR0B, UDRIE0)) {
+		host_interrupt(USART_UDRE_vect);
+		replies[length++] = UDR0;
+	}
+	replies[length] = '\0';
+#if BUS_DRIVER_ENABLE
+	// and lets go once the last byte has been shifted out
+	if (length > 0) {
+		CHECK(BIT_IS_SET(BUS_DE_PORT, BUS_DE_PIN) && BIT_IS_SET(UCSR0B, TXCIE0),
+			"bus let go before the last byte of the reply to \"%s\" went out", line);
+		host_interrupt(USART_TX_vect);
+	}
+	CHECK(!BIT_IS_SET(BUS_DE_PORT, BUS_DE_PIN) && !BIT_IS_SET(UCSR0B, TXCIE0), "bus still driven after \"%s\"",
+		line);
+#endif
+	return result;
+}
+
+// a line that must be ignored: no command, no reply
+static void check_ignored(const char *line) {
+	CHECK(bus_line(line) == EVENT_NONE && replies[0] == '\0' && !bus_command_ready,
+		"\"%s\" was taken (reply \"%s\")", line, replies);
+}
+
+static void check_reply(const char *line, const char *reply) {
+	bus_line(line);
+	CHECK(strcmp(replies, reply) == 0, "\"%s\" got \"%s\", expected \"%s\"", line, replies, reply);
+}
+
+static void check_address(void) {
+	// this unit, leading zeros are still this unit
+	CHECK(bus_line("@3 dim 600") == EVENT_BUS_COMMAND && bus_addressed, "\"@3 dim 600\" not taken");
+	CHECK(strcmp(bus_command_text, "dim") == 0 && bus_argument != NULL && strcmp(bus_argument, "600") == 0,
+		"\"@3 dim 600\" split into \"%s\" \"%s\"", bus_command_text, bus_argument ? bus_argument : "(none)");
+	check_reply("@003 poll", "#3 idle 0 0\n");
+	// broadcast: acted on, never answered
+	CHECK(bus_line("@* off") == EVENT_BUS_COMMAND && !bus_addressed, "\"@* off\" not taken as a broadcast");
+	CHECK(replies[0] == '\0', "broadcast answered with \"%s\"", replies);
+	check_reply("@* poll", "");
+	// other units and things that aren't addresses
+	check_ignored("@4 poll");
+	check_ignored("@30 poll");
+	check_ignored("@ poll");
+	check_ignored("@3poll");
+	check_ignored("@3");
+	check_ignored("3 poll");
+	check_ignored("@65539 poll");
+	check_ignored("@*poll");
+	check_ignored("");
+	check_reply("@3 flash", "#3 unknown command\n");
+}
+
+static void check_length(void) {
+	// the longest line that fits in the frame buffer
+	char line[BUS_FRAME_LENGTH + 8];
+	memset(line, 'x', sizeof(line));
+	memcpy(line, "@3 ", 3);
+	line[BUS_FRAME_LENGTH - 1] = '\0';
+	check_reply(line, "#3 unknown command\n");
+	// one more byte and the whole line is dropped, even the part that would have fitted
+	memcpy(line, "@3 poll ", 8);
+	line[BUS_FRAME_LENGTH - 1] = 'x';
+	line[BUS_FRAME_LENGTH] = '\0';
+	check_ignored(line);
+	line[BUS_FRAME_LENGTH + 6] = '\0';
+	check_ignored(line);
+	// and the next line is received as normal
+	check_reply("@3 poll", "#3 idle 0 0\n");
+}
+
+static void check_id(void) {
+	// a broadcast can't give every unit the same ID
+	check_reply("@* id 9", "");
+	CHECK(bus_id == ID && eeprom_read_byte(&bus_id_eeprom) == ID, "broadcast changed the ID to %u", bus_id);
+	check_reply("@3 id", "#3 bad id\n");
+	check_reply("@3 id 0", "#3 bad id\n");
+	check_reply("@3 id 248", "#3 bad id\n");
+	check_reply("@3 id 65539", "#3 bad id\n");
+	check_reply("@3 id 12a", "#3 bad id\n");
+	check_reply("@3 id -5", "#3 bad id\n");
+	CHECK(bus_id == ID && eeprom_read_byte(&bus_id_eeprom) == ID, "a bad ID changed the ID to %u", bus_id);
+	// the reply comes from the old ID, then only the new one answers
+	check_reply("@3 id 247", "#3 ok\n");
+	CHECK(bus_id == 247 && eeprom_read_byte(&bus_id_eeprom) == 247, "ID is %u (EEPROM %u) after changing it to 247",
+		bus_id, eeprom_read_byte(&bus_id_eeprom));
+	check_ignored("@3 poll");
+	check_reply("@247 poll", "#247 idle 0 0\n");
+}
+
+int main(void) {
+	sei();
+	bus_id = ID;
+	eeprom_update_byte(&bus_id_eeprom, ID);
+	check_address();
+	check_length();
+	check_id();
+#if BUS_DRIVER_ENABLE
+	return check_result("test_bus (driver enable)");
+#else
+	return check_result("test_bus");
+#endif
+}
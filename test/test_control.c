@@ -0,0 +1,114 @@
+// closed loop controller: control_step() drives a first order model of the bulb and light sensor, and the steps must
+// settle on the target without much overshoot, never change the bulb by more than the slew limit, and come back off
+// the limit straight away after a target it couldn't reach
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define CLOSED_LOOP_MODE (1)
+#include "sketch.h"
+#include "check.h"
+
+// the sensor reads PLANT_AMBIENT with the bulb off and PLANT_FULL with it at BULB_LEVEL_MAX, and moves
+// PLANT_RESPONSE of the way to the new light level every sample (a time constant of about 3 samples, 50ms)
+#define PLANT_AMBIENT 200.0
+#define PLANT_FULL 800.0
+#define PLANT_RESPONSE 0.3
+// within this many ADC counts of the target counts as settled, which has to happen within SETTLE_SAMPLES of the
+// time the slew limit needs to get the bulb to the right level
+#define SETTLED_COUNTS 3
+#define SETTLE_SAMPLES 100
+#define MAX_OVERSHOOT 10
+// samples the unreachable target is held for, long enough to wind the integral up all the way
+#define WINDUP_SAMPLES 2000
+
+static double plant_reading;
+static uint16_t plant_level;
+
+// start the controller the way start_control() does, with the plant settled at 'level'
+static void plant_start(uint16_t level) {
+	plant_level = level;
+	plant_reading = PLANT_AMBIENT + (PLANT_FULL - PLANT_AMBIENT) * level / BULB_LEVEL_MAX;
+	control_integral = (int32_t)level << (8 - PWM_DITHER_BITS);
+	control_output = level;
+}
+
+// one sample: the controller sees the current (rounded) reading, then the plant responds to the new level
+// returns the new level
+static uint16_t plant_step(uint16_t target) {
+	uint16_t level = control_step(target, (uint16_t)lround(plant_reading));
+	int change = (int)level - (int)plant_level;
+	CHECK(abs(change) <= CONTROL_SLEW << PWM_DITHER_BITS, "bulb level changed by %d in one sample", change);
+	CHECK(level <= BULB_LEVEL_MAX, "bulb level %u", level);
+	plant_level = level;
+	double light = PLANT_AMBIENT + (PLANT_FULL - PLANT_AMBIENT) * level / BULB_LEVEL_MAX;
+	plant_reading += (light - plant_reading) * PLANT_RESPONSE;
+	return level;
+}
+
+// step the target from where the plant is and check the response
+static void check_step(uint16_t from_level, uint16_t target) {
+	plant_start(from_level);
+	double start = plant_reading;
+	double level = (target - PLANT_AMBIENT) * BULB_LEVEL_MAX / (PLANT_FULL - PLANT_AMBIENT);
+	unsigned limit = fabs(level - from_level) / (CONTROL_SLEW << PWM_DITHER_BITS) + SETTLE_SAMPLES;
+	double overshoot = 0;
+	unsigned settled = 0;
+	for (unsigned sample = 1; sample <= limit * 2; sample++) {
+		plant_step(target);
+		double past = target > start ? plant_reading - target : target - plant_reading;
+		if (past > overshoot) {
+			overshoot = past;
+		}
+		if (fabs(plant_reading - target) > SETTLED_COUNTS) {
+			settled = 0;
+		}
+		else if (settled == 0) {
+			settled = sample;
+		}
+	}
+	printf("step %.0f -> %u: settled after %u samples (limit %u), overshoot %.1f counts\n", start, target, settled, limit,
+		overshoot);
+	CHECK(settled != 0 && settled <= limit, "step %.0f -> %u settled after %u samples", start, target, settled);
+	CHECK(overshoot <= MAX_OVERSHOOT, "step %.0f -> %u overshot by %.1f counts", start, target, overshoot);
+}
+
+// a target above what the bulb can reach: the output sits at full and the integral mustn't keep growing, so when
+// the target comes back into range the bulb starts coming down on the very next sample
+static void check_windup(void) {
+	plant_start(BULB_LEVEL(190));
+	for (unsigned sample = 0; sample < WINDUP_SAMPLES; sample++) {
+		plant_step(PLANT_FULL + 100);
+	}
+	CHECK(plant_level == BULB_LEVEL_MAX, "bulb at %u with the target out of reach", plant_level);
+	CHECK(control_integral <= CONTROL_FULL, "integral wound up to %ld", (long)control_integral);
+	uint16_t target = 500;
+	CHECK(plant_step(target) < BULB_LEVEL_MAX, "bulb still at full one sample after the target came back into range");
+	unsigned samples = 1;
+	while (fabs(plant_reading - target) > SETTLED_COUNTS && samples < SETTLE_SAMPLES * 4) {
+		plant_step(target);
+		samples++;
+	}
+	printf("windup: integral %ld after %u samples out of reach, back to the target in %u samples\n",
+		(long)control_integral, WINDUP_SAMPLES, samples);
+	// BULB_LEVEL_MAX down to the level for 500 takes 64 samples at the slew limit
+	CHECK(samples <= 64 + SETTLE_SAMPLES, "took %u samples to come back from the limit", samples);
+
+	// and the same at the bottom: a target below the ambient light turns the bulb off without winding down
+	for (unsigned sample = 0; sample < WINDUP_SAMPLES; sample++) {
+		plant_step(PLANT_AMBIENT - 100);
+	}
+	CHECK(plant_level == 0, "bulb at %u with the target below the ambient light", plant_level);
+	CHECK(control_integral >= 0, "integral wound down to %ld", (long)control_integral);
+	CHECK(plant_step(target) > 0, "bulb still off one sample after the target came back into range");
+}
+
+int main(void) {
+	// steps up and down from the starting levels initial_ocr() picks
+	check_step(BULB_LEVEL(190), 600);
+	check_step(BULB_LEVEL(190), 400);
+	check_step(BULB_LEVEL(68), 700);
+	check_step(BULB_LEVEL(255), 300);
+	check_windup();
+	return check_result("test_control");
+}
@@ -0,0 +1,413 @@
+// stress test for the data shared between the ISRs and the main loop: a timer interrupts the main loop with signals
+// every 20us, and the signal handler runs ISR code the way the hardware would (only while the I bit is set, see
+// host.h). Covers the event queue, the serial transmit ring and the countdown top/bottom half. The signals land at
+// random points, which is only an approximation of an interrupt at every instruction boundary, so the main loop side
+// of the event queue and the transmit ring is also single stepped with the ISR run at each boundary (test_stepped())
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sketch.h"
+#include "check.h"
+
+#define EVENTS 100000
+#define LINES 10000
+#define SHORT_LINES 1000000
+#define COUNTDOWN_SECONDS 7200
+// each interrupt does up to this many ISRs' worth of work so the queue and ring also fill up
+#define BURST 16
+// the main loop does up to this many loops of other work between steps so it isn't always waiting on the ISRs
+// (and the interrupts land inside the code under test)
+#define MAIN_WORK 60000
+
+static volatile unsigned long interrupts = 0;
+// what the interrupt handler does, set by each test
+static void (*volatile interrupt)(void) = NULL;
+// random numbers for the main loop and the interrupts (rand() isn't safe to call from a signal handler)
+static uint32_t main_random = 1;
+static uint32_t interrupt_random = 2;
+
+static uint32_t next_random(uint32_t *state) {
+	*state = *state * 1103515245 + 12345;
+	return *state >> 8;
+}
+
+static void main_work(void) {
+	for (volatile uint32_t i = next_random(&main_random) % MAIN_WORK; i > 0; i--);
+}
+
+static void on_interrupt(void) {
+	interrupts++;
+	if (interrupt != NULL) {
+		interrupt();
+	}
+}
+
+static void interrupts_start(void (*handler)(void)) {
+	interrupt = handler;
+	// about as often as signals can be taken, they land at unrelated points in the main loop code
+	host_timer_start(on_interrupt, 20000);
+}
+
+static void interrupts_stop(void) {
+	host_timer_stop();
+	interrupt = NULL;
+}
+
+// event queue: the handler posts numbered events while there is room (an event posted to a full queue is dropped
+// and the next one would be out of sequence), the main loop must take every one of them exactly once and in order
+static volatile unsigned event_posted = 0;
+static volatile unsigned event_full = 0;
+
+static void post_numbered_events(void) {
+	for (int burst = next_random(&interrupt_random) % BURST; burst >= 0 && event_posted < EVENTS; burst--) {
+		if (((event_head + 1) & (EVENT_QUEUE_SIZE - 1)) == event_tail) {
+			event_full++;
+			return;
+		}
+		event_post(event_posted % 255 + 1);
+		event_posted++;
+	}
+}
+
+static void test_event_queue(void) {
+	unsigned received = 0;
+	unsigned wrong = 0;
+	interrupts_start(post_numbered_events);
+	while (received < EVENTS) {
+		uint8_t event = event_get();
+		if (event != EVENT_NONE) {
+			if (event != received % 255 + 1) {
+				wrong++;
+			}
+			received++;
+		}
+		if (received % 16 == 0) {
+			main_work();
+		}
+	}
+	interrupts_stop();
+	CHECK(wrong == 0, "%u of %u events out of order or corrupted", wrong, received);
+	CHECK(event_get() == EVENT_NONE, "events left over after all %u were taken", EVENTS);
+	printf("event queue: %u events, queue full %u times, %lu interrupts\n", received, event_full, interrupts);
+}
+
+// transmit ring: the handler is the data register empty ISR, the main loop sends numbered lines with uart_printf()
+// and the bytes that come out must be exactly those lines
+static char *sent;
+static size_t sent_length = 0;
+
+static void uart_data_register_empty(void) {
+	for (int burst = next_random(&interrupt_random) % BURST; burst >= 0 && BIT_IS_SET(UCSR0B, UDRIE0); burst--) {
+		host_interrupt(USART_UDRE_vect);
+		sent[sent_length++] = UDR0;
+	}
+}
+
+static void uart_wait_empty(void) {
+	while (BIT_IS_SET(UCSR0B, UDRIE0));
+}
+
+static void test_transmit_ring(void) {
+	sent = malloc(LINES * 16);
+	sent_length = 0;
+	interrupts_start(uart_data_register_empty);
+	for (unsigned i = 0; i < LINES; i++) {
+		uart_printf(PSTR("line %u %S\n"), i, i % 2 ? PSTR("odd") : PSTR("even"));
+		main_work();
+	}
+	uart_wait_empty();
+	interrupts_stop();
+	size_t position = 0;
+	unsigned wrong = 0;
+	for (unsigned i = 0; i < LINES; i++) {
+		char expected[32];
+		int length = snprintf(expected, sizeof(expected), "line %u %s\n", i, i % 2 ? "odd" : "even");
+		if (position + length > sent_length || memcmp(&sent[position], expected, length) != 0) {
+			wrong++;
+			break;
+		}
+		position += length;
+	}
+	CHECK(wrong == 0 && position == sent_length, "output differs from the lines sent at byte %zu of %zu", position,
+		sent_length);
+	printf("transmit ring: %u lines, %zu bytes\n", LINES, sent_length);
+	free(sent);
+}
+
+// one byte lines sent back to back, with a handler that empties the ring every time: the ISR often sends a line
+// before uart_send_line() has started it, and it must not be started again on the empty ring (that sends a stale byte)
+static void uart_drain(void) {
+	while (BIT_IS_SET(UCSR0B, UDRIE0)) {
+		host_interrupt(USART_UDRE_vect);
+		sent[sent_length++] = UDR0;
+	}
+}
+
+static void test_short_lines(void) {
+	sent = malloc(SHORT_LINES * 2);
+	sent_length = 0;
+	interrupts_start(uart_drain);
+	for (unsigned i = 0; i < SHORT_LINES; i++) {
+		uart_send_line_wait("x", 1);
+	}
+	uart_wait_empty();
+	interrupts_stop();
+	size_t stray = 0;
+	for (size_t i = 0; i < sent_length; i++) {
+		stray += sent[i] != 'x';
+	}
+	CHECK(sent_length == SHORT_LINES && stray == 0, "%u one byte lines came out as %zu bytes, %zu of them wrong",
+		SHORT_LINES, sent_length, stray);
+	printf("short lines: %u lines, %zu bytes\n", SHORT_LINES, sent_length);
+	free(sent);
+}
+
+// countdown: the handler is the timer 1 compare ISR (one second per interrupt) along with the transmit ISR, the main
+// loop runs the bottom half. It has to catch up whenever it falls behind and finish with a single done event
+static void countdown_interrupts(void) {
+	if (BIT_IS_SET(TIMSK1, OCIE1A)) {
+		host_interrupt(TIMER1_COMPA_vect);
+	}
+	uart_data_register_empty();
+}
+
+static void test_countdown(void) {
+	sent = malloc(COUNTDOWN_SECONDS * 16);
+	sent_length = 0;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		time_int = COUNTDOWN_SECONDS;
+		time_selected = 1;
+	}
+	start_countdown(0);
+	interrupts_start(countdown_interrupts);
+	unsigned done = 0;
+	uint8_t event;
+	do {
+		event = event_next();
+		if (event == EVENT_COUNTDOWN_DONE) {
+			done++;
+		}
+		main_work();
+	} while (event != EVENT_COUNTDOWN_DONE);
+	// anything still queued must be a tick, and the ISR has stopped
+	while ((event = event_next()) != EVENT_NONE) {
+		CHECK(0, "event %u after the countdown finished", event);
+	}
+	uart_wait_empty();
+	interrupts_stop();
+	CHECK(done == 1, "countdown finished %u times", done);
+	CHECK(elapsed_time == COUNTDOWN_SECONDS + 1, "elapsed_time is %lu", (unsigned long)elapsed_time);
+	CHECK(strcmp(countdown_string, "00:00:00") == 0, "countdown ended at %s", countdown_string);
+	CHECK(!matrix_enabled, "LED matrix still being scanned after the countdown finished");
+	// the status lines can be skipped but the ones sent must count down
+	sent[sent_length] = '\0';
+	unsigned long previous = COUNTDOWN_SECONDS + 1;
+	unsigned lines = 0;
+	for (char *line = strtok(sent, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+		unsigned hours, minutes, seconds;
+		if (sscanf(line, "%2u:%2u:%2u", &hours, &minutes, &seconds) != 3 || strlen(line) != 8) {
+			CHECK(0, "bad status line \"%s\"", line);
+			break;
+		}
+		unsigned long remaining = hours * 3600UL + minutes * 60 + seconds;
+		CHECK(remaining < previous, "status line %s after %lu seconds", line, previous);
+		previous = remaining;
+		lines++;
+	}
+	printf("countdown: %u seconds, %u status lines sent\n", COUNTDOWN_SECONDS, lines);
+	free(sent);
+	clear();
+}
+
+// deterministic preemption: the timer above fires at random points, so nothing guarantees every point is covered.
+// Here the main loop side of the event queue and the transmit ring is single stepped (the x86 trap flag raises
+// SIGTRAP after each instruction) and the ISR is run once at each instruction boundary in turn, a fresh pass for
+// every boundary. One that comes due with the I bit clear is taken at the first boundary after it is set again, like a
+// pending interrupt. The boundaries are the host build's: a read-modify-write that is one x86 instruction (SET_BIT on a
+// register) has none inside it, where the AVR's lds/ori/sts has two
+#if defined(__x86_64__)
+#define STEPPING 1
+#else
+#define STEPPING 0
+#endif
+
+#if STEPPING
+static volatile unsigned long step_count;
+static volatile unsigned long step_due;
+static volatile uint8_t step_taken;
+static void (*volatile step_isr)(void);
+
+static void on_step(int signal) {
+	(void)signal;
+	step_count++;
+	if (!step_taken && step_count >= step_due && BIT_IS_SET(SREG, SREG_I)) {
+		step_taken = 1;
+		step_isr();
+	}
+}
+
+static void __attribute__((noinline)) step_start(void) {
+	__asm__ volatile ("pushfq; orq $0x100, (%%rsp); popfq" ::: "memory", "cc");
+}
+
+static void __attribute__((noinline)) step_stop(void) {
+	__asm__ volatile ("pushfq; andq $~0x100, (%%rsp); popfq" ::: "memory", "cc");
+}
+
+// runs operation() once with isr() at each of its instruction boundaries, setup() before and check() after each pass
+// returns how many boundaries there were
+static unsigned long step_through(void (*setup)(void), void (*operation)(void), void (*isr)(void),
+		void (*check)(unsigned long step)) {
+	step_isr = isr;
+	unsigned long due;
+	for (due = 1; ; due++) {
+		setup();
+		step_count = 0;
+		step_due = due;
+		step_taken = 0;
+		step_start();
+		operation();
+		step_stop();
+		// every boundary done, the ISR wasn't reached
+		if (!step_taken) {
+			break;
+		}
+		check(due);
+	}
+	return due - 1;
+}
+
+// event queue: the main loop takes an event while the ISR posts the next number, starting with queue_events already
+// queued from queue_start. What event_get() returned followed by the rest of the queue must be 1, 2, 3... with
+// nothing missing or repeated (the ISR's event is dropped if the queue was still full)
+static uint8_t queue_start, queue_events, queue_got;
+
+static void queue_setup(void) {
+	event_head = event_tail = queue_start;
+	for (event_posted = 0; event_posted < queue_events; event_posted++) {
+		event_post(event_posted + 1);
+	}
+}
+
+static void queue_post_next(void) {
+	if (event_post(event_posted + 1)) {
+		event_posted++;
+	}
+}
+
+static void queue_isr(void) {
+	host_interrupt(queue_post_next);
+}
+
+static void queue_operation(void) {
+	queue_got = event_get();
+}
+
+static void queue_check(unsigned long step) {
+	unsigned expected = 1;
+	unsigned wrong = 0;
+	if (queue_got != EVENT_NONE) {
+		wrong += queue_got != expected++;
+	}
+	for (uint8_t event = event_get(); event != EVENT_NONE; event = event_get()) {
+		wrong += event != expected++;
+	}
+	CHECK(wrong == 0 && expected == event_posted + 1, "%u queued from %u, ISR at step %lu: %u of %u events wrong",
+		queue_events, queue_start, step, wrong, event_posted);
+}
+
+// transmit ring: a line is sent while the ISR empties the ring, starting with ring_queued already in it from
+// ring_start. Exactly ring_queued and the line must come out, and the ISR must be off once the ring is empty
+static const char *ring_queued;
+static uint8_t ring_start;
+#define RING_LINE "xyz"
+
+static void ring_setup(void) {
+	sent_length = 0;
+	uart_tx_head = uart_tx_tail = ring_start;
+	CLEAR_BIT(UCSR0B, UDRIE0);
+	uart_send_line(ring_queued, strlen(ring_queued));
+}
+
+static void ring_send(void) {
+	uart_send_line(RING_LINE, strlen(RING_LINE));
+}
+
+// the receiver is switched off and on, UCSR0B is written by the ISR as well
+static void ring_receive_toggle(void) {
+	uart_receive_enable(0);
+	uart_receive_enable(1);
+}
+
+static void ring_check(const char *expected, unsigned long step) {
+	uart_drain();
+	size_t length = strlen(expected);
+	CHECK(sent_length == length && memcmp(sent, expected, length) == 0 && uart_tx_tail == uart_tx_head,
+		"\"%s\" queued from %u, ISR at step %lu: sent \"%.*s\"", ring_queued, ring_start, step,
+		(int)(sent_length < 64 ? sent_length : 64), sent);
+}
+
+static void ring_send_check(unsigned long step) {
+	char expected[64];
+	snprintf(expected, sizeof(expected), "%s%s", ring_queued, RING_LINE);
+	ring_check(expected, step);
+}
+
+static void ring_toggle_check(unsigned long step) {
+	ring_check(ring_queued, step);
+	CHECK(BIT_IS_SET(UCSR0B, RXEN0), "receiver left off, ISR at step %lu", step);
+}
+
+static void test_stepped(void) {
+	// no signals to block, SIGTRAP is never blocked and on_step() checks the I bit itself
+	int interrupt_signal = host_interrupt_signal;
+	host_interrupt_signal = 0;
+	struct sigaction action = {0};
+	action.sa_handler = on_step;
+	sigaction(SIGTRAP, &action, NULL);
+	unsigned long steps = 0;
+	// empty, part full and full, and across the end of the queue
+	const uint8_t starts[] = {0, EVENT_QUEUE_SIZE - 2};
+	const uint8_t counts[] = {0, 2, EVENT_QUEUE_SIZE - 1};
+	for (unsigned i = 0; i < sizeof(starts); i++) {
+		for (unsigned j = 0; j < sizeof(counts); j++) {
+			queue_start = starts[i];
+			queue_events = counts[j];
+			steps += step_through(queue_setup, queue_operation, queue_isr, queue_check);
+		}
+	}
+	printf("stepped event queue: ISR at each of %lu instruction boundaries\n", steps);
+	sent = malloc(UART_TX_BUFFER_SIZE * 2);
+	steps = 0;
+	// idle and already sending, and across the end of the ring
+	const uint8_t ring_starts[] = {0, UART_TX_BUFFER_SIZE - 2};
+	const char *queued[] = {"", "ab"};
+	for (unsigned i = 0; i < sizeof(ring_starts); i++) {
+		for (unsigned j = 0; j < sizeof(queued) / sizeof(queued[0]); j++) {
+			ring_start = ring_starts[i];
+			ring_queued = queued[j];
+			steps += step_through(ring_setup, ring_send, uart_drain, ring_send_check);
+			steps += step_through(ring_setup, ring_receive_toggle, uart_drain, ring_toggle_check);
+		}
+	}
+	printf("stepped transmit ring: ISR at each of %lu instruction boundaries\n", steps);
+	free(sent);
+	action.sa_handler = SIG_DFL;
+	sigaction(SIGTRAP, &action, NULL);
+	host_interrupt_signal = interrupt_signal;
+}
+#endif
+
+int main(void) {
+	sei();
+	test_event_queue();
+	test_transmit_ring();
+	test_short_lines();
+	test_countdown();
+#if STEPPING
+	test_stepped();
+#endif
+	return check_result("test_events");
+}
@@ -0,0 +1,319 @@
+// I2C LCD: a model of the TWI, the PCF8574 backpack and the HD44780 behind it. The TWI carries out each step the
+// program starts (start, address, data byte, stop), the backpack acknowledges its address and every byte and puts it
+// on its outputs, and the HD44780 latches a nibble on each falling edge of enable and puts the instructions and
+// characters back together. Covers lcd_init() and lcd_write_string() through the TWI interrupt and polled with
+// interrupts off, transfers that aren't acknowledged (lcd_i2c_service() drops the queue and counts an error), and
+// the LED matrix columns that move to PD4 and PD5 to free SDA and SCL
+#include <stdio.h>
+
+#define LCD_USING_I2C (1)
+#include "sketch.h"
+#include "check.h"
+
+// TWSR status codes for a master transmitter
+#define TW_START 0x08
+#define TW_REP_START 0x10
+#define TW_MT_SLA_ACK 0x18
+#define TW_MT_SLA_NACK 0x20
+#define TW_MT_DATA_ACK 0x28
+#define TW_MT_DATA_NACK 0x30
+// set along with TWINT when the model finishes a step. The program only ever writes all of TWCR, so TWINT without
+// this is a new step to carry out (writing TWINT as 1 is what clears the flag and starts the TWI)
+#define TWI_DONE (1 << 8)
+
+static volatile uint16_t twi_control;
+static uint8_t twi_started = 0;
+static uint8_t twi_expect_address = 0;
+static uint8_t twi_addressed = 0;
+static unsigned twi_starts = 0;
+// not acknowledged: the address of every transfer, or the data byte after this many have been taken (0 for none)
+static uint8_t twi_nack_address = 0;
+static unsigned twi_nack_after = 0;
+
+// PCF8574 outputs and the bytes it has taken
+static uint8_t backpack = 0;
+static unsigned backpack_bytes = 0;
+static unsigned backpack_bad = 0;
+
+// HD44780: 8 bit interface at power up, D0-D3 aren't wired to the backpack and read as 0
+static uint8_t hd_four_bit = 0;
+static uint8_t hd_nibble_pending = 0;
+static uint8_t hd_high = 0;
+static uint8_t hd_ddram[0x80];
+static uint8_t hd_cgram[0x40];
+static uint8_t hd_address = 0;
+static uint8_t hd_cgram_selected = 0;
+static uint8_t hd_increment = 1;
+static uint8_t hd_display_on = 0;
+static uint8_t hd_two_lines = 0;
+
+static void hd_instruction(uint8_t value) {
+	if (value & 0x80) {
+		hd_cgram_selected = 0;
+		hd_address = value & 0x7F;
+	}
+	else if (value & 0x40) {
+		hd_cgram_selected = 1;
+		hd_address = value & 0x3F;
+	}
+	else if (value & 0x20) {
+		hd_four_bit = !(value & 0x10);
+		hd_two_lines = (value & 0x08) != 0;
+		hd_nibble_pending = 0;
+	}
+	else if (value & 0x10) {
+		// cursor or display shift, not used
+	}
+	else if (value & 0x08) {
+		hd_display_on = (value & 0x04) != 0;
+	}
+	else if (value & 0x04) {
+		hd_increment = (value & 0x02) != 0;
+	}
+	else if (value & 0x02) {
+		hd_cgram_selected = 0;
+		hd_address = 0;
+	}
+	else if (value & 0x01) {
+		memset(hd_ddram, ' ', sizeof(hd_ddram));
+		hd_cgram_selected = 0;
+		hd_address = 0;
+		hd_increment = 1;
+	}
+}
+
+static void hd_data(uint8_t value) {
+	if (hd_cgram_selected) {
+		hd_cgram[hd_address] = value;
+		hd_address = (hd_address + 1) & 0x3F;
+	}
+	else {
+		hd_ddram[hd_address] = value;
+		hd_address = (hd_address + (hd_increment ? 1 : -1)) & 0x7F;
+	}
+}
+
+// enable going low: the HD44780 takes D4-D7 and RS
+static void hd_latch(uint8_t outputs) {
+	uint8_t nibble = outputs >> 4;
+	uint8_t value;
+	if (!hd_four_bit) {
+		value = nibble << 4;
+	}
+	else if (!hd_nibble_pending) {
+		hd_high = nibble;
+		hd_nibble_pending = 1;
+		return;
+	}
+	else {
+		value = hd_high << 4 | nibble;
+		hd_nibble_pending = 0;
+	}
+	if (outputs & LCD_I2C_RS) {
+		hd_data(value);
+	}
+	else {
+		hd_instruction(value);
+	}
+}
+
+static void backpack_write(uint8_t outputs) {
+	backpack_bytes++;
+	// R/W must stay low (the LCD is never read) and the backlight on
+	if ((outputs & LCD_I2C_RW) || !(outputs & LCD_I2C_BACKLIGHT)) {
+		backpack_bad++;
+	}
+	if ((backpack & LCD_I2C_ENABLE) && !(outputs & LCD_I2C_ENABLE)) {
+		hd_latch(backpack);
+	}
+	backpack = outputs;
+}
+
+// carry out the step the program started, returns 1 if one finished and TWINT is set again
+static uint8_t twi_step(void) {
+	uint16_t control = twi_control;
+	if (!(control & (1 << TWINT)) || (control & TWI_DONE) || !(control & (1 << TWEN))) {
+		return 0;
+	}
+	if (control & (1 << TWSTO)) {
+		// the bus is let go, TWSTO clears itself and TWINT isn't set
+		twi_started = 0;
+		twi_control = control & ~(1 << TWSTO | 1 << TWINT);
+		return 0;
+	}
+	uint8_t status;
+	if (control & (1 << TWSTA)) {
+		status = twi_started ? TW_REP_START : TW_START;
+		twi_started = 1;
+		twi_expect_address = 1;
+		twi_starts++;
+	}
+	else if (twi_expect_address) {
+		twi_expect_address = 0;
+		twi_addressed = TWDR == (LCD_I2C_ADDRESS << 1) && !twi_nack_address;
+		status = twi_addressed ? TW_MT_SLA_ACK : TW_MT_SLA_NACK;
+	}
+	else if (twi_addressed && (twi_nack_after == 0 || backpack_bytes < twi_nack_after)) {
+		backpack_write(TWDR);
+		status = TW_MT_DATA_ACK;
+	}
+	else {
+		status = TW_MT_DATA_NACK;
+	}
+	TWSR = status | (TWSR & 0x03);
+	twi_control = control | TWI_DONE;
+	return 1;
+}
+
+// the program polls TWINT with interrupts off (see lcd_flush()), the TWI carries on when it looks
+volatile uint16_t *host_twcr(void) {
+	if (!BIT_IS_SET(SREG, SREG_I)) {
+		twi_step();
+	}
+	return &twi_control;
+}
+
+// each timer signal: the TWI finishes a step and interrupts if the program asked it to
+static void twi_interrupt(void) {
+	twi_step();
+	uint16_t control = twi_control;
+	if ((control & (1 << TWINT)) && (control & TWI_DONE) && (control & (1 << TWIE))) {
+		host_interrupt(TWI_vect);
+	}
+}
+
+// timer 1 counts a tick each time it is read so the power up wait in lcd_init() ends
+volatile uint16_t *host_tcnt1(void) {
+	static uint16_t count = 0;
+	count++;
+	return &count;
+}
+
+// the characters on a line of the display
+static const char *hd_line(uint8_t row) {
+	static char line[17];
+	memcpy(line, &hd_ddram[row * 0x40], 16);
+	line[16] = '\0';
+	return line;
+}
+
+static void check_line(uint8_t row, const char *expected, const char *when) {
+	CHECK(strncmp(hd_line(row), expected, strlen(expected)) == 0, "line %u is \"%s\" %s, expected \"%s\"", row,
+		hd_line(row), when, expected);
+}
+
+static void check_idle(const char *when) {
+	CHECK(!_lcd_i2c_busy && _lcd_i2c_head == _lcd_i2c_tail, "queue not empty %s", when);
+	// lcd_flush() returns once the stop is started, the TWI finishes it after that like lcd_i2c_queue() waits for
+	while (BIT_IS_SET(TWCR, TWSTO));
+	CHECK(!twi_started, "bus not let go %s", when);
+}
+
+static void test_init(void) {
+	setup_lcd();
+	lcd_write_string(0, 0, "Enter a time");
+	lcd_write_string(2, 1, "01:30:00");
+	lcd_flush();
+	CHECK(hd_four_bit && hd_two_lines && hd_display_on && hd_increment, "LCD set up as %s bit, %s line, display %s",
+		hd_four_bit ? "4" : "8", hd_two_lines ? "2" : "1", hd_display_on ? "on" : "off");
+	check_line(0, "Enter a time    ", "after lcd_init()");
+	check_line(1, "  01:30:00      ", "after lcd_init()");
+	// the brightness bars: character n has its left n columns lit on every row
+	uint8_t bars_ok = 1;
+	for (uint8_t character = 1; character <= 5; character++) {
+		uint8_t row_bits = (0x1F << (5 - character)) & 0x1F;
+		for (uint8_t row = 0; row < 8; row++) {
+			if (hd_cgram[character * 8 + row] != row_bits) {
+				bars_ok = 0;
+			}
+		}
+	}
+	CHECK(bars_ok, "brightness bar characters not as created");
+	CHECK(_lcd_i2c_errors == 0 && backpack_bad == 0, "%u errors, %u bad bytes", _lcd_i2c_errors, backpack_bad);
+	check_idle("after lcd_init()");
+	printf("lcd_init: %u bytes in %u transfers\n", backpack_bytes, twi_starts);
+}
+
+static void test_polled(void) {
+	unsigned bytes = backpack_bytes;
+	// more than the queue holds, so lcd_i2c_queue() has to run the TWI itself too
+	cli();
+	lcd_write_string(0, 0, "Goodnight!      ");
+	lcd_write_string(0, 1, "Fading   0:59:58");
+	lcd_flush();
+	sei();
+	check_line(0, "Goodnight!      ", "written with interrupts off");
+	check_line(1, "Fading   0:59:58", "written with interrupts off");
+	CHECK(_lcd_i2c_errors == 0, "%u errors with interrupts off", _lcd_i2c_errors);
+	check_idle("with interrupts off");
+	printf("polled: %u bytes\n", backpack_bytes - bytes);
+}
+
+static void test_not_acknowledged(void) {
+	// nothing at the address: every transfer is given up on, lcd_flush() still returns and the display is untouched
+	twi_nack_address = 1;
+	lcd_write_string(0, 0, "Lost");
+	lcd_flush();
+	twi_nack_address = 0;
+	CHECK(_lcd_i2c_errors > 0, "address not acknowledged and no error counted");
+	check_line(0, "Goodnight!", "when the address wasn't acknowledged");
+	check_idle("after the address wasn't acknowledged");
+	// a byte not acknowledged in the middle of a transfer: the rest of the queue is dropped. Each character is 4
+	// bytes (a nibble with enable high then low, twice), this stops after the cursor is set and 2 characters are
+	// written so the HD44780 isn't left half way through a character, which lcd_i2c_service() can't tell or put right
+	uint8_t errors = _lcd_i2c_errors;
+	cli();
+	twi_nack_after = backpack_bytes + 3 * 4;
+	lcd_write_string(0, 0, "Dropped");
+	lcd_flush();
+	twi_nack_after = 0;
+	sei();
+	CHECK(_lcd_i2c_errors == errors + 1, "%u errors counted for a byte not acknowledged", _lcd_i2c_errors - errors);
+	check_line(0, "Drodnight!", "after a byte wasn't acknowledged");
+	check_idle("after a byte wasn't acknowledged");
+	// and the next write goes through
+	lcd_write_string(0, 0, "Back    ");
+	lcd_flush();
+	check_line(0, "Back    t!", "after the errors");
+	check_idle("after the errors");
+}
+
+static void test_matrix_columns(void) {
+	// SDA and SCL are PC4 and PC5, the matrix must leave them alone
+	CHECK((MATRIX_COLUMNS_PORTC_MASK & (1 << 4 | 1 << 5)) == 0, "matrix columns on SDA/SCL");
+	CHECK(MATRIX_COLUMNS_PORTD_MASK == (1 << 4 | 1 << 5), "matrix columns on PORTD are %02x",
+		MATRIX_COLUMNS_PORTD_MASK);
+	CHECK((MATRIX_COLUMNS_PORTD_MASK & (MATRIX_ROWS_PORTD_MASK | 1 << 0 | 1 << 1 | 1 << 6)) == 0,
+		"matrix columns on PORTD share a pin with the rows, the UART or the bus driver enable");
+	DDRC = 0;
+	DDRD = 0;
+	setup_led_matrix();
+	CHECK((DDRC & (1 << 4 | 1 << 5)) == 0, "SDA/SCL made outputs by setup_led_matrix()");
+	CHECK((DDRD & (1 << 4 | 1 << 5)) == (1 << 4 | 1 << 5), "PD4/PD5 not made outputs by setup_led_matrix()");
+	// scan a frame: each column on by itself, PC4/PC5 never driven
+	time_selected = 0;
+	matrix_start();
+	uint8_t scan_ok = 1;
+	for (uint8_t column = 0; column < MATRIX_COLUMNS * 2; column++) {
+		host_interrupt(TIMER0_OVF_vect);
+		uint8_t on = column % MATRIX_COLUMNS;
+		if ((PORTC & (MATRIX_COLUMNS_PORTC_MASK | 1 << 4 | 1 << 5)) != matrix_columns_portc[on] ||
+			(PORTD & MATRIX_COLUMNS_PORTD_MASK) != matrix_columns_portd[on]) {
+			scan_ok = 0;
+		}
+	}
+	matrix_stop();
+	CHECK(scan_ok, "matrix scan drove the wrong column pins");
+	CHECK((PORTD & MATRIX_COLUMNS_PORTD_MASK) == 0, "columns left on after matrix_stop()");
+}
+
+int main(void) {
+	sei();
+	host_timer_start(twi_interrupt, 20000);
+	test_init();
+	test_polled();
+	test_not_acknowledged();
+	host_timer_stop();
+	test_matrix_columns();
+	return check_result("test_lcd_i2c");
+}
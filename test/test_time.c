@@ -0,0 +1,58 @@
+// tests for reading the time typed in and counting it down
+#include <stdio.h>
+
+#include "sketch.h"
+#include "check.h"
+
+static void check_time(const char *text, uint32_t expected) {
+	char buffer[TIME_STRING_LENGTH];
+	strncpy(buffer, text, sizeof(buffer) - 1);
+	buffer[sizeof(buffer) - 1] = '\0';
+	time_int = 0;
+	uint8_t valid = string_to_time(buffer);
+	uint32_t seconds = valid ? time_int : 0;
+	CHECK(seconds == expected, "\"%s\" read as %lu, expected %lu", text, (unsigned long)seconds,
+		(unsigned long)expected);
+}
+
+int main(void) {
+	check_time("90", 90);
+	check_time("1:30", 90);
+	check_time("1:30:00", 5400);
+	check_time("99:59:59", MAX_TIME);
+	check_time("59:59", 3599);
+	check_time("90:00", 5400);
+	check_time("1h30m", 5400);
+	check_time("45s", 45);
+	check_time("2h 5s", 7205);
+	// 0 means invalid
+	check_time("0", 0);
+	check_time("", 0);
+	check_time("abc", 0);
+	check_time("100:00:00", 0);
+	check_time("360000", 0);
+	// minutes and seconds after a ':' must be under 60
+	check_time("59:99", 0);
+	check_time("1:75:00", 0);
+	check_time("1:00:60", 0);
+	check_time("1:2:3:4", 0);
+
+	// counting "hh:mm:ss" down a second at a time matches converting from seconds, and nothing left of the position
+	// returned changes
+	char countdown[9];
+	char previous[9];
+	char expected[9];
+	time_to_string(MAX_TIME, countdown);
+	for (uint32_t seconds = MAX_TIME; seconds > 0; seconds--) {
+		memcpy(previous, countdown, sizeof(previous));
+		uint8_t changed = countdown_decrement(countdown);
+		time_to_string(seconds - 1, expected);
+		uint8_t same = strcmp(countdown, expected) == 0 && memcmp(countdown, previous, changed) == 0;
+		CHECK(same, "counting down from %lu gave %s, expected %s", (unsigned long)seconds, countdown, expected);
+		if (!same) {
+			break;
+		}
+	}
+
+	return check_result("test_time");
+}
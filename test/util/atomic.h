@@ -0,0 +1,11 @@
+// host stand-in for util/atomic.h: clears the I bit for the block and restores it on the way out, like avr-libc
+#ifndef HOST_UTIL_ATOMIC_H
+#define HOST_UTIL_ATOMIC_H
+#include "../host.h"
+
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON 1
+#define ATOMIC_BLOCK(type) \
+	for (uint8_t _host_sreg __attribute__((cleanup(host_restore))) = host_cli() | ((type) << SREG_I), \
+		_host_todo = 1; _host_todo; _host_todo = 0)
+#endif
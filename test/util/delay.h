@@ -0,0 +1,8 @@
+// host stand-in for util/delay.h: delays are passed to host_delay_us(), which only a simulation acts on
+#ifndef HOST_UTIL_DELAY_H
+#define HOST_UTIL_DELAY_H
+#include "../host.h"
+
+#define _delay_us(us) host_delay_us(us)
+#define _delay_ms(ms) host_delay_us((ms) * 1000.0)
+#endif